@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "dspenc.h"
+
+/* Sound bank encoder
+ * Clips are handed out to worker threads one at a time; each worker keeps
+ * its PCM buffer and correlator records across clips so thousands of short
+ * clips don't each pay for fresh scratch allocations. Each clip loops on
+ * its own smpl chunk, if it has one.
+ */
+struct bank_clip
+{
+    struct dspadpcm_header header;
+    int64_t samples;
+    unsigned char* adpcm;
+    int64_t adpcmBytes;
+    int err;
+};
+
+struct bank_job
+{
+    char** paths;
+    struct bank_clip* clips;
+    int count;
+    int next;
+    const struct dsp_tuning* tuning;
+    int loopAlign;
+    pthread_mutex_t lock;
+};
+
+struct bank_worker
+{
+    struct bank_job* job;
+    pthread_t thread;
+    int threaded;
+};
+
+static int EncodeClip(const char* path, struct bank_clip* clip, struct clip_scratch* scratch,
+                      const struct dsp_tuning* tuning, int loopAlign)
+{
+    struct wav_info wav;
+    if (ClipLoadWAV(path, scratch, &wav))
+        return 1;
+
+    int64_t samples = wav.sampleCount;
+    struct dsp_loop loop;
+    if (ClipApplyLoop(scratch, &samples, &wav.loop, loopAlign, path, &loop))
+        return 1;
+
+    int64_t packetCount = samples / PACKET_SAMPLES + (samples % PACKET_SAMPLES != 0);
+    clip->samples = samples;
+    clip->adpcm = malloc(packetCount * PACKET_BYTES);
+    clip->adpcmBytes = GetBytesForAdpcmSamples(samples);
+    ClipEncode(scratch->pcm, samples, wav.sampleRate, scratch, tuning, &loop, &clip->header, clip->adpcm);
+
+    return 0;
+}
+
+static void* BankWorker(void* arg)
+{
+    struct bank_worker* worker = arg;
+    struct bank_job* job = worker->job;
+
+    struct clip_scratch scratch;
+    ClipScratchInit(&scratch, 0);
+
+    if (worker->threaded)
+        TraceSetThreadName("bank worker");
+
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->count)
+            break;
+
+        struct trace_span span;
+        TraceBegin(&span, "encode clip");
+        job->clips[i].err = EncodeClip(job->paths[i], &job->clips[i], &scratch, job->tuning, job->loopAlign);
+        TraceEnd(&span, job->clips[i].adpcmBytes, job->clips[i].samples);
+    }
+
+    ClipScratchFree(&scratch);
+    return NULL;
+}
+
+static uint64_t AlignUp(uint64_t offset, uint32_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+int BankEncode(const char* bankPath, char** clipPaths, int clipCount, int threadCount,
+               const struct dsp_tuning* tuning, uint32_t alignment, int loopAlign)
+{
+    struct bank_job job = {};
+    job.paths = clipPaths;
+    job.clips = calloc(sizeof(struct bank_clip), clipCount);
+    job.count = clipCount;
+    job.tuning = tuning;
+    job.loopAlign = loopAlign;
+    pthread_mutex_init(&job.lock, NULL);
+
+    if (threadCount > clipCount)
+        threadCount = clipCount;
+    struct bank_worker* workers = calloc(sizeof(struct bank_worker), threadCount);
+
+    /* First worker runs on the calling thread */
+    for (int t=0 ; t<threadCount ; ++t)
+        workers[t].job = &job;
+    for (int t=1 ; t<threadCount ; ++t)
+    {
+        workers[t].threaded = 1;
+        if (pthread_create(&workers[t].thread, NULL, BankWorker, &workers[t]))
+            workers[t].threaded = 0;
+    }
+    BankWorker(&workers[0]);
+    for (int t=1 ; t<threadCount ; ++t)
+        if (workers[t].threaded)
+            pthread_join(workers[t].thread, NULL);
+
+    int ret = 0;
+    for (int i=0 ; i<clipCount ; ++i)
+        if (job.clips[i].err)
+            ret = 1;
+
+    /* Lay out payloads after the table */
+    struct dspbank_entry* entries = calloc(sizeof(struct dspbank_entry), clipCount);
+    uint64_t offset = sizeof(struct dspbank_header) + sizeof(struct dspbank_entry) * (uint64_t)clipCount;
+    for (int i=0 ; i<clipCount && !ret ; ++i)
+    {
+        offset = AlignUp(offset, alignment);
+        if (offset + job.clips[i].adpcmBytes > UINT32_MAX)
+        {
+            fprintf(stderr, "'%s' exceeds the 4 GB bank limit\n", bankPath);
+            ret = 1;
+            break;
+        }
+        entries[i].offset = DSPBig32((uint32_t)offset);
+        entries[i].size = DSPBig32((uint32_t)job.clips[i].adpcmBytes);
+        entries[i].header = job.clips[i].header;
+        offset += job.clips[i].adpcmBytes;
+    }
+
+    FILE* fout = NULL;
+    if (!ret)
+    {
+        fout = fopen(bankPath, "wb");
+        if (!fout)
+        {
+            fprintf(stderr, "'%s' won't open - %s\n", bankPath, strerror(errno));
+            ret = 1;
+        }
+    }
+
+    if (!ret)
+    {
+        struct trace_span span;
+        TraceBegin(&span, "write");
+
+        struct dspbank_header header = {};
+        memcpy(header.magic, "DSPB", 4);
+        header.version = DSPBig32(DSPBANK_VERSION);
+        header.count = DSPBig32(clipCount);
+        header.alignment = DSPBig32(alignment);
+        fwrite(&header, 1, sizeof(header), fout);
+        fwrite(entries, sizeof(struct dspbank_entry), clipCount, fout);
+        uint64_t pos = sizeof(header) + sizeof(struct dspbank_entry) * (uint64_t)clipCount;
+
+        static const unsigned char zeros[64] = {};
+        for (int i=0 ; i<clipCount ; ++i)
+        {
+            /* Zero padding up to the aligned payload */
+            uint64_t pad = DSPBig32(entries[i].offset) - pos;
+            while (pad > 0)
+            {
+                size_t n = pad < 64 ? pad : 64;
+                fwrite(zeros, 1, n, fout);
+                pad -= n;
+            }
+            fwrite(job.clips[i].adpcm, 1, job.clips[i].adpcmBytes, fout);
+            pos = DSPBig32(entries[i].offset) + job.clips[i].adpcmBytes;
+        }
+
+        TraceEnd(&span, pos, 0);
+        fclose(fout);
+        printf("DONE! %d clips packed into '%s'\n", clipCount, bankPath);
+    }
+
+    for (int i=0 ; i<clipCount ; ++i)
+        free(job.clips[i].adpcm);
+    free(entries);
+    free(workers);
+    free(job.clips);
+    pthread_mutex_destroy(&job.lock);
+
+    return ret;
+}
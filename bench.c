@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "dspenc.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+/* Synthetic corpus used when no WAVs are given */
+#define SYNTH_RATE 32000
+#define SYNTH_SAMPLES SYNTH_RATE
+
+/* Speed/quality benchmark
+ * Every combination of the knobs that change the output is encoded
+ * single-threaded over the corpus. A configuration is on the Pareto frontier
+ * when no other one is both faster and cleaner. The analysis chunk only
+ * moves throughput, so it's swept on its own at the default settings.
+ */
+struct bench_clip
+{
+    int16_t* pcm;
+    int64_t samples;
+};
+
+struct bench_result
+{
+    struct dsp_tuning tuning;
+    double rate;
+    double snr;
+};
+
+static const double THRESHOLDS[] = {1.0, 10.0, 100.0};
+static const int PASSES[] = {1, 2, 8};
+static const int LEVELS[] = {1, 2, 3};
+static const int SCALE_SEARCHES[] = {SCALE_SEARCH_SINGLE, SCALE_SEARCH_RETRY, SCALE_SEARCH_FULL};
+static const int CANDIDATES[] = {1, 2, 4, 8};
+static const int CHUNKS[] = {64, 256, 1024, 4096, 16384};
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof(a[0])))
+
+static int16_t Clamp16(double v)
+{
+    return (int16_t)(v >= 32767.0 ? 32767 : v <= -32768.0 ? -32768 : lround(v));
+}
+
+/* Deterministic noise in [-1, 1) */
+static double Noise(uint32_t* state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return (*state >> 8) / 8388608.0 - 1.0;
+}
+
+/* Sweep, decaying chord, noise, drum hits and a square wave */
+static void MakeSynthCorpus(struct bench_clip clips[5])
+{
+    uint32_t seed = 1;
+
+    for (int c=0 ; c<5 ; ++c)
+    {
+        clips[c].samples = SYNTH_SAMPLES;
+        clips[c].pcm = malloc(SYNTH_SAMPLES * sizeof(int16_t));
+    }
+
+    double phase = 0.0;
+    for (int s=0 ; s<SYNTH_SAMPLES ; ++s)
+    {
+        double t = (double)s / SYNTH_RATE;
+
+        /* Log chirp from 50 Hz to 12 kHz */
+        phase += 2.0 * M_PI * 50.0 * pow(240.0, t) / SYNTH_RATE;
+        clips[0].pcm[s] = Clamp16(16384.0 * sin(phase));
+
+        /* Decaying harmonic chord */
+        double chord = 0.0;
+        for (int h=1 ; h<=6 ; ++h)
+            chord += sin(2.0 * M_PI * 220.0 * h * t) / h + sin(2.0 * M_PI * 277.2 * h * t) / h;
+        clips[1].pcm[s] = Clamp16(8000.0 * exp(-2.0 * t) * chord);
+
+        clips[2].pcm[s] = Clamp16(8192.0 * Noise(&seed));
+
+        /* Noise bursts every quarter second */
+        double beat = fmod(t, 0.25);
+        clips[3].pcm[s] = Clamp16(24000.0 * exp(-40.0 * beat) * Noise(&seed));
+
+        clips[4].pcm[s] = fmod(t * 220.0, 1.0) < 0.5 ? 12000 : -12000;
+    }
+}
+
+static int LoadCorpus(char** wavPaths, int wavCount, struct bench_clip* clips)
+{
+    struct clip_scratch scratch;
+    ClipScratchInit(&scratch, 0);
+
+    for (int c=0 ; c<wavCount ; ++c)
+    {
+        struct wav_info wav;
+        if (ClipLoadWAV(wavPaths[c], &scratch, &wav))
+        {
+            ClipScratchFree(&scratch);
+            return 1;
+        }
+        clips[c].samples = wav.sampleCount;
+        clips[c].pcm = malloc(wav.sampleCount * sizeof(int16_t));
+        memcpy(clips[c].pcm, scratch.pcm, wav.sampleCount * sizeof(int16_t));
+    }
+
+    ClipScratchFree(&scratch);
+    return 0;
+}
+
+/* Encode the corpus; fills in throughput and the mean per-clip SNR. Clips
+ * encoded losslessly have no finite SNR and are left out of the mean, which
+ * is only infinite when every clip is lossless */
+static void RunTuning(const struct bench_clip* clips, int clipCount, struct clip_scratch* scratch,
+                      unsigned char* adpcm, struct bench_result* result)
+{
+    double seconds = 0.0, snrSum = 0.0;
+    int64_t samples = 0;
+    int lossyClips = 0;
+
+    for (int c=0 ; c<clipCount ; ++c)
+    {
+        struct dspadpcm_header header;
+        double start = GetSeconds();
+        ClipEncode(clips[c].pcm, clips[c].samples, SYNTH_RATE, scratch, &result->tuning, NULL, &header, adpcm);
+        seconds += GetSeconds() - start;
+        samples += clips[c].samples;
+
+        /* Decode back against the source */
+        short coefs[16];
+        DSPGetHeaderCoefs(&header, coefs);
+
+        short hist[2] = {0};
+        short pcmOut[PACKET_SAMPLES];
+        double signal = 0.0, noise = 0.0;
+        for (int64_t p=0 ; p*PACKET_SAMPLES<clips[c].samples ; ++p)
+        {
+            int numSamples = (int)MIN(clips[c].samples - p * PACKET_SAMPLES, PACKET_SAMPLES);
+            const int16_t* src = clips[c].pcm + p * PACKET_SAMPLES;
+            DSPDecodeFrame(adpcm + p * PACKET_BYTES, numSamples, hist, (const short(*)[2])coefs, pcmOut);
+            for (int s=0 ; s<numSamples ; ++s)
+            {
+                double err = (double)src[s] - pcmOut[s];
+                signal += (double)src[s] * src[s];
+                noise += err * err;
+            }
+        }
+        double snr = GetSNR(signal, noise);
+        if (isfinite(snr))
+        {
+            snrSum += snr;
+            ++lossyClips;
+        }
+    }
+
+    result->rate = samples / seconds / 1.0e6;
+    result->snr = lossyClips ? snrSum / lossyClips : INFINITY;
+}
+
+static const char* ScaleSearchName(int scaleSearch)
+{
+    switch (scaleSearch)
+    {
+    case SCALE_SEARCH_SINGLE:
+        return "single";
+    case SCALE_SEARCH_FULL:
+        return "full";
+    default:
+        return "retry";
+    }
+}
+
+static const char* PresetName(const struct dsp_tuning* tuning)
+{
+    for (const struct dsp_preset* preset=DSP_PRESETS ; preset->name ; ++preset)
+    {
+        const struct dsp_tuning* t = preset->tuning;
+        if (t->recordThreshold == tuning->recordThreshold && t->kmeansPasses == tuning->kmeansPasses &&
+            t->splitLevels == tuning->splitLevels && t->scaleSearch == tuning->scaleSearch &&
+            t->candidates == tuning->candidates)
+            return preset->name;
+    }
+    return "";
+}
+
+static void PrintResult(const struct bench_result* r)
+{
+    printf(" %10.3f  %9.3f  %9.1f  %6d  %6d  %6s  %2d  %s\n", r->rate, r->snr,
+           r->tuning.recordThreshold, r->tuning.kmeansPasses, r->tuning.splitLevels,
+           ScaleSearchName(r->tuning.scaleSearch), r->tuning.candidates, PresetName(&r->tuning));
+}
+
+static int CompareRate(const void* a, const void* b)
+{
+    double ra = ((const struct bench_result*)a)->rate;
+    double rb = ((const struct bench_result*)b)->rate;
+    return (ra < rb) - (ra > rb);
+}
+
+int BenchRun(char** wavPaths, int wavCount)
+{
+    int clipCount = wavCount ? wavCount : 5;
+    struct bench_clip* clips = calloc(sizeof(struct bench_clip), clipCount);
+    if (!wavCount)
+        MakeSynthCorpus(clips);
+    else if (LoadCorpus(wavPaths, wavCount, clips))
+    {
+        for (int c=0 ; c<clipCount ; ++c)
+            free(clips[c].pcm);
+        free(clips);
+        return 1;
+    }
+
+    int64_t maxSamples = 0, totalSamples = 0;
+    for (int c=0 ; c<clipCount ; ++c)
+    {
+        maxSamples = clips[c].samples > maxSamples ? clips[c].samples : maxSamples;
+        totalSamples += clips[c].samples;
+    }
+    unsigned char* adpcm = malloc((maxSamples / PACKET_SAMPLES + 1) * PACKET_BYTES);
+
+    int configCount = COUNT(THRESHOLDS) * COUNT(PASSES) * COUNT(LEVELS) * COUNT(SCALE_SEARCHES) * COUNT(CANDIDATES);
+    struct bench_result* results = calloc(sizeof(struct bench_result), configCount);
+    printf("BENCH: %d clips, %" PRId64 " samples, %d configurations\n", clipCount, totalSamples, configCount);
+
+    struct clip_scratch scratch;
+    ClipScratchInit(&scratch, 0);
+
+    int n = 0;
+    for (int a=0 ; a<COUNT(THRESHOLDS) ; ++a)
+    for (int b=0 ; b<COUNT(PASSES) ; ++b)
+    for (int c=0 ; c<COUNT(LEVELS) ; ++c)
+    for (int d=0 ; d<COUNT(SCALE_SEARCHES) ; ++d)
+    for (int e=0 ; e<COUNT(CANDIDATES) ; ++e)
+    {
+        struct bench_result* r = &results[n++];
+        r->tuning = *DSPDefaultTuning();
+        r->tuning.recordThreshold = THRESHOLDS[a];
+        r->tuning.kmeansPasses = PASSES[b];
+        r->tuning.splitLevels = LEVELS[c];
+        r->tuning.scaleSearch = SCALE_SEARCHES[d];
+        r->tuning.candidates = CANDIDATES[e];
+        RunTuning(clips, clipCount, &scratch, adpcm, r);
+        printf("\rBENCH [ %d / %d ]          ", n, configCount);
+        fflush(stdout);
+    }
+    printf("\n\n");
+
+    /* Fastest first; each frontier entry is cleaner than everything faster */
+    qsort(results, configCount, sizeof(struct bench_result), CompareRate);
+    printf("Pareto frontier\n");
+    printf(" Msamples/s   SNR (dB)  threshold  passes  levels   scale   k  preset\n");
+    double bestSnr = -INFINITY;
+    for (int i=0 ; i<configCount ; ++i)
+    {
+        if (results[i].snr <= bestSnr)
+            continue;
+        bestSnr = results[i].snr;
+        PrintResult(&results[i]);
+    }
+
+    printf("\nPresets\n");
+    printf(" Msamples/s   SNR (dB)  threshold  passes  levels   scale   k  preset\n");
+    for (const struct dsp_preset* preset=DSP_PRESETS ; preset->name ; ++preset)
+    {
+        struct bench_result r = {.tuning = *preset->tuning};
+        RunTuning(clips, clipCount, &scratch, adpcm, &r);
+        PrintResult(&r);
+    }
+
+    printf("\nAnalysis chunk at default settings\n");
+    printf("  packets  Msamples/s\n");
+    for (int i=0 ; i<COUNT(CHUNKS) ; ++i)
+    {
+        struct bench_result r = {.tuning = *DSPDefaultTuning()};
+        r.tuning.chunkPackets = CHUNKS[i];
+        RunTuning(clips, clipCount, &scratch, adpcm, &r);
+        printf("  %7d  %10.3f\n", CHUNKS[i], r.rate);
+    }
+
+    ClipScratchFree(&scratch);
+    free(results);
+    free(adpcm);
+    for (int c=0 ; c<clipCount ; ++c)
+        free(clips[c].pcm);
+    free(clips);
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "dspenc.h"
+
+/* Whole-clip encoding in memory
+ * Scratch buffers are owned by the caller (typically one per worker
+ * thread) and only ever grow, so a warm worker encodes without allocating.
+ */
+void ClipScratchInit(struct clip_scratch* scratch, int64_t samples)
+{
+    scratch->correlator = DSPCorrelatorCreate(DSPDefaultTuning());
+    scratch->pcm = NULL;
+    scratch->pcmCap = 0;
+    if (samples)
+        ClipScratchReserve(scratch, samples);
+}
+
+void ClipScratchFree(struct clip_scratch* scratch)
+{
+    DSPCorrelatorFree(scratch->correlator);
+    free(scratch->pcm);
+}
+
+int16_t* ClipScratchReserve(struct clip_scratch* scratch, int64_t samples)
+{
+    if (samples > scratch->pcmCap)
+    {
+        scratch->pcmCap = samples;
+        scratch->pcm = realloc(scratch->pcm, samples * 2);
+    }
+    return scratch->pcm;
+}
+
+/* Read a whole WAV into scratch->pcm */
+int ClipLoadWAV(const char* path, struct clip_scratch* scratch, struct wav_info* wav)
+{
+    FILE* fin = WAVOpen(path, wav);
+    if (!fin)
+        return 1;
+
+    if (wav->sampleCount > MAX_STREAM_SAMPLES)
+    {
+        fprintf(stderr, "'%s' is too long for a single stream\n", path);
+        fclose(fin);
+        return 1;
+    }
+
+    ClipScratchReserve(scratch, wav->sampleCount);
+    WAVSeekSample(fin, wav, 0);
+    WAVReadSamples(fin, scratch->pcm, wav->sampleCount);
+    fclose(fin);
+
+    return 0;
+}
+
+/* Lay the clip in scratch->pcm out for its loop; loopOut gets stream positions */
+int ClipApplyLoop(struct clip_scratch* scratch, int64_t* samples, const struct dsp_loop* loop, int align,
+                  const char* name, struct dsp_loop* loopOut)
+{
+    struct stream_layout layout;
+    LoopLayoutInit(&layout, 0, *samples);
+    if (LoopLayoutApply(&layout, loop, align, name))
+        return 1;
+
+    if (layout.samples > MAX_STREAM_SAMPLES)
+    {
+        fprintf(stderr, "'%s' is too long for a single stream\n", name);
+        return 1;
+    }
+
+    ClipScratchReserve(scratch, layout.samples);
+    LoopArrange(&layout, scratch->pcm);
+    *samples = layout.samples;
+    *loopOut = layout.loop;
+    return 0;
+}
+
+/* Correlate and encode a clip; adpcmOut needs room for every packet
+ * loop is in stream positions, or NULL */
+void ClipEncode(const int16_t* pcm, int64_t samples, uint32_t sampleRate, struct clip_scratch* scratch,
+                const struct dsp_tuning* tuning, const struct dsp_loop* loop,
+                struct dspadpcm_header* headerOut, unsigned char* adpcmOut)
+{
+    int16_t coefs[16];
+    DSPCorrelatorReset(scratch->correlator, tuning);
+    DSPCorrelateFeed(scratch->correlator, pcm, samples);
+    DSPCorrelateFinish(scratch->correlator, coefs);
+
+    /* Encoding pauses at the loop packet to note the history entering it */
+    int64_t split = loop && loop->end >= 0 ? loop->start / PACKET_SAMPLES * PACKET_SAMPLES : samples;
+    short hist[2] = {0};
+    DSPEncodeBuffer(pcm, split, (const short(*)[2])coefs, hist, adpcmOut, tuning);
+    short loopHist[2] = {hist[0], hist[1]};
+    unsigned char* loopPacket = adpcmOut + split / PACKET_SAMPLES * PACKET_BYTES;
+    DSPEncodeBuffer(pcm + split, samples - split, (const short(*)[2])coefs, hist, loopPacket, tuning);
+
+    DSPInitHeader(headerOut, samples, sampleRate, coefs);
+    DSPSetHeaderPs(headerOut, adpcmOut);
+    if (loop && loop->end >= 0)
+        DSPSetHeaderLoop(headerOut, loop, loopPacket, loopHist, (const short(*)[2])coefs);
+}
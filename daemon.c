@@ -0,0 +1,605 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "dspenc.h"
+
+/* Persistent encode daemon
+ * One connection carries one job: a request header, the input and output
+ * paths, then (for inline jobs) the PCM samples in host order. The reply is
+ * a status header followed by either the .dsp bytes or an error message.
+ * Each connection's request is read on its own thread and only queued once
+ * complete, so a slow upload or a stalled client never holds up the rest.
+ * Jobs are queued by priority and served by a warm worker pool whose
+ * scratch memory persists between jobs.
+ */
+#define DAEMON_REQUEST_MAGIC "DSPJ"
+#define DAEMON_RESPONSE_MAGIC "DSPR"
+
+/* Scratch preallocated per worker */
+#define DAEMON_SCRATCH_SAMPLES 0x100000
+
+/* Clients that stall this long mid-request or mid-reply are dropped */
+#define DAEMON_IO_TIMEOUT_SECS 10
+
+struct daemon_request
+{
+    char magic[4];
+    uint32_t flags;
+    uint32_t sampleRate;
+    uint32_t loopAlign;
+    struct dsp_tuning tuning;
+    struct dsp_loop loop; /* Inline: the source loop; path jobs: overrides smpl if end >= 0 */
+    uint64_t sampleCount;
+    uint32_t inPathLen;
+    uint32_t outPathLen;
+};
+
+struct daemon_response
+{
+    char magic[4];
+    int32_t status;
+    uint64_t dataSize;
+};
+
+struct daemon_job
+{
+    int fd;
+    struct daemon_request req;
+    char* inPath;
+    char* outPath;
+    int16_t* pcm;
+    struct daemon_job* next;
+};
+
+/* Interactive jobs always drain before batch jobs; FIFO within each */
+struct daemon_queue
+{
+    struct daemon_job* head[2];
+    struct daemon_job* tail[2];
+    int stopping;
+    int closing; /* Shutdown requested; no more connections */
+    int readers; /* Connections still being read */
+    int listenFd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct daemon_conn
+{
+    struct daemon_queue* queue;
+    int fd;
+};
+
+static int ReadFull(int fd, void* buf, size_t size)
+{
+    char* p = buf;
+    while (size)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int WriteFull(int fd, const void* buf, size_t size)
+{
+    const char* p = buf;
+    while (size)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int OpenSocket(const char* socketPath, struct sockaddr_un* addr)
+{
+    if (strlen(socketPath) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "'%s' is too long for a socket path\n", socketPath);
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        fprintf(stderr, "socket failed - %s\n", strerror(errno));
+    return fd;
+}
+
+static void SendResponse(int fd, int status, const void* data, uint64_t dataSize)
+{
+    struct daemon_response resp;
+    memcpy(resp.magic, DAEMON_RESPONSE_MAGIC, 4);
+    resp.status = status;
+    resp.dataSize = dataSize;
+    if (!WriteFull(fd, &resp, sizeof(resp)) && dataSize)
+        WriteFull(fd, data, dataSize);
+}
+
+static void SendError(int fd, const char* msg, const char* path)
+{
+    char buf[PATH_MAX + 128];
+    snprintf(buf, sizeof(buf), msg, path);
+    SendResponse(fd, 1, buf, strlen(buf));
+}
+
+static void FreeJob(struct daemon_job* job)
+{
+    if (job->fd >= 0)
+        close(job->fd);
+    free(job->inPath);
+    free(job->outPath);
+    free(job->pcm);
+    free(job);
+}
+
+/* Reads a job off a fresh connection; NULL if it's malformed */
+static struct daemon_job* ReadJob(int fd)
+{
+    struct daemon_job* job = calloc(sizeof(struct daemon_job), 1);
+    job->fd = fd;
+
+    if (ReadFull(fd, &job->req, sizeof(job->req)) ||
+        memcmp(job->req.magic, DAEMON_REQUEST_MAGIC, 4) ||
+        job->req.inPathLen >= PATH_MAX || job->req.outPathLen >= PATH_MAX)
+    {
+        FreeJob(job);
+        return NULL;
+    }
+
+    job->inPath = calloc(job->req.inPathLen + 1, 1);
+    job->outPath = calloc(job->req.outPathLen + 1, 1);
+    if (ReadFull(fd, job->inPath, job->req.inPathLen) ||
+        ReadFull(fd, job->outPath, job->req.outPathLen))
+    {
+        FreeJob(job);
+        return NULL;
+    }
+
+    if (!DSPTuningValid(&job->req.tuning) || job->req.loopAlign > LOOP_ALIGN_UNROLL)
+    {
+        static const char msg[] = "encoder tuning is out of range";
+        SendResponse(fd, 1, msg, sizeof(msg) - 1);
+        FreeJob(job);
+        return NULL;
+    }
+
+    if (job->req.flags & DAEMON_INLINE)
+    {
+        if (!job->req.sampleCount || job->req.sampleCount > MAX_STREAM_SAMPLES)
+        {
+            static const char msg[] = "inline PCM is empty or too long for a single stream";
+            SendResponse(fd, 1, msg, sizeof(msg) - 1);
+            FreeJob(job);
+            return NULL;
+        }
+        job->pcm = malloc(job->req.sampleCount * 2);
+        if (!job->pcm || ReadFull(fd, job->pcm, job->req.sampleCount * 2))
+        {
+            FreeJob(job);
+            return NULL;
+        }
+    }
+
+    return job;
+}
+
+/* Returns the samples encoded, 0 if the job failed */
+static int64_t RunJob(struct daemon_job* job, struct clip_scratch* scratch,
+                      unsigned char** dspBuf, int64_t* dspCap)
+{
+    const int16_t* pcm;
+    int64_t samples;
+    uint32_t sampleRate;
+    struct dsp_loop sourceLoop = job->req.loop;
+
+    if (job->req.flags & DAEMON_INLINE)
+    {
+        pcm = job->pcm;
+        samples = job->req.sampleCount;
+        sampleRate = job->req.sampleRate;
+    }
+    else
+    {
+        struct wav_info wav;
+        if (ClipLoadWAV(job->inPath, scratch, &wav))
+        {
+            SendError(job->fd, "'%s' could not be read as mono 16-bit PCM", job->inPath);
+            return 0;
+        }
+        pcm = scratch->pcm;
+        samples = wav.sampleCount;
+        sampleRate = wav.sampleRate;
+        if (sourceLoop.end < 0)
+            sourceLoop = wav.loop;
+    }
+
+    /* Loop layout rearranges the samples, so inline PCM moves to scratch first */
+    struct dsp_loop loop = {0, -1};
+    if (sourceLoop.end >= 0)
+    {
+        if (pcm != scratch->pcm)
+            memcpy(ClipScratchReserve(scratch, samples), pcm, samples * 2);
+        const char* name = job->inPath[0] ? job->inPath : "inline PCM";
+        if (ClipApplyLoop(scratch, &samples, &sourceLoop, job->req.loopAlign, name, &loop))
+        {
+            SendError(job->fd, "'%s' loop points don't fit the stream", name);
+            return 0;
+        }
+        pcm = scratch->pcm;
+    }
+
+    /* Header and packets are assembled contiguously as the .dsp file image */
+    int64_t packetCount = samples / PACKET_SAMPLES + (samples % PACKET_SAMPLES != 0);
+    int64_t need = sizeof(struct dspadpcm_header) + packetCount * PACKET_BYTES;
+    if (need > *dspCap)
+    {
+        *dspCap = need;
+        *dspBuf = realloc(*dspBuf, need);
+    }
+
+    struct dspadpcm_header header;
+    ClipEncode(pcm, samples, sampleRate, scratch, &job->req.tuning, &loop, &header,
+               *dspBuf + sizeof(struct dspadpcm_header));
+    memcpy(*dspBuf, &header, sizeof(header));
+    int64_t dspSize = sizeof(header) + GetBytesForAdpcmSamples(samples);
+
+    if (!job->outPath[0])
+    {
+        SendResponse(job->fd, 0, *dspBuf, dspSize);
+        return samples;
+    }
+
+    FILE* fout = fopen(job->outPath, "wb");
+    if (!fout)
+    {
+        SendError(job->fd, "'%s' won't open for writing", job->outPath);
+        return 0;
+    }
+    fwrite(*dspBuf, 1, dspSize, fout);
+    fclose(fout);
+    SendResponse(job->fd, 0, NULL, 0);
+    return samples;
+}
+
+static void* DaemonWorker(void* arg)
+{
+    struct daemon_queue* queue = arg;
+
+    struct clip_scratch scratch;
+    ClipScratchInit(&scratch, DAEMON_SCRATCH_SAMPLES);
+    int64_t dspCap = sizeof(struct dspadpcm_header) + DAEMON_SCRATCH_SAMPLES / PACKET_SAMPLES * PACKET_BYTES;
+    unsigned char* dspBuf = malloc(dspCap);
+
+    TraceSetThreadName("daemon worker");
+
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (!queue->head[0] && !queue->head[1] && !queue->stopping)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+
+        int prio = queue->head[0] ? 0 : 1;
+        struct daemon_job* job = queue->head[prio];
+        if (job)
+        {
+            queue->head[prio] = job->next;
+            if (!job->next)
+                queue->tail[prio] = NULL;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        /* Queue drained and stopping */
+        if (!job)
+            break;
+
+        struct trace_span span;
+        TraceBegin(&span, prio ? "batch job" : "interactive job");
+        int64_t samples = RunJob(job, &scratch, &dspBuf, &dspCap);
+        TraceEnd(&span, samples * 2, samples);
+        FreeJob(job);
+    }
+
+    free(dspBuf);
+    ClipScratchFree(&scratch);
+    return NULL;
+}
+
+static void* DaemonReader(void* arg)
+{
+    struct daemon_conn* conn = arg;
+    struct daemon_queue* queue = conn->queue;
+    struct daemon_job* job = ReadJob(conn->fd);
+    free(conn);
+
+    /* Reply before the accept loop can wind down and exit the process */
+    int shutdownJob = job && (job->req.flags & DAEMON_SHUTDOWN);
+    if (shutdownJob)
+    {
+        SendResponse(job->fd, 0, NULL, 0);
+        FreeJob(job);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    if (shutdownJob)
+    {
+        /* Wakes the accept loop */
+        if (!queue->closing)
+            shutdown(queue->listenFd, SHUT_RDWR);
+        queue->closing = 1;
+    }
+    else if (job)
+    {
+        int prio = (job->req.flags & DAEMON_BATCH) ? 1 : 0;
+        if (queue->tail[prio])
+            queue->tail[prio]->next = job;
+        else
+            queue->head[prio] = job;
+        queue->tail[prio] = job;
+    }
+    --queue->readers;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+int DaemonServe(const char* socketPath, int threadCount)
+{
+    struct sockaddr_un addr;
+    int lfd = OpenSocket(socketPath, &addr);
+    if (lfd < 0)
+        return 1;
+
+    /* Replace a stale socket from a previous run, but nothing else */
+    struct stat st;
+    if (!lstat(socketPath, &st))
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            fprintf(stderr, "'%s' exists and isn't a socket\n", socketPath);
+            close(lfd);
+            return 1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int live = probe >= 0 && !connect(probe, (struct sockaddr*)&addr, sizeof(addr));
+        if (probe >= 0)
+            close(probe);
+        if (live)
+        {
+            fprintf(stderr, "'%s' is in use by a running daemon\n", socketPath);
+            close(lfd);
+            return 1;
+        }
+        unlink(socketPath);
+    }
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) || listen(lfd, 64))
+    {
+        fprintf(stderr, "'%s' won't listen - %s\n", socketPath, strerror(errno));
+        close(lfd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct daemon_queue queue = {};
+    queue.listenFd = lfd;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+
+    pthread_t* threads = calloc(sizeof(pthread_t), threadCount);
+    int workerCount = 0, err = 0;
+    for (int t=0 ; t<threadCount ; ++t)
+    {
+        err = pthread_create(&threads[workerCount], NULL, DaemonWorker, &queue);
+        if (!err)
+            ++workerCount;
+    }
+    if (!workerCount)
+    {
+        fprintf(stderr, "'%s' has no workers - %s\n", socketPath, strerror(err));
+        close(lfd);
+        unlink(socketPath);
+        free(threads);
+        pthread_cond_destroy(&queue.cond);
+        pthread_mutex_destroy(&queue.lock);
+        return 1;
+    }
+
+    printf("LISTENING on '%s' with %d workers\n", socketPath, workerCount);
+    fflush(stdout);
+
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+
+    for (;;)
+    {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        struct timeval timeout = {DAEMON_IO_TIMEOUT_SECS, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&queue.lock);
+        int closing = queue.closing;
+        if (!closing)
+            ++queue.readers;
+        pthread_mutex_unlock(&queue.lock);
+        if (closing)
+        {
+            close(fd);
+            break;
+        }
+
+        struct daemon_conn* conn = malloc(sizeof(struct daemon_conn));
+        conn->queue = &queue;
+        conn->fd = fd;
+        pthread_t reader;
+        if (pthread_create(&reader, &detached, DaemonReader, conn))
+        {
+            close(fd);
+            free(conn);
+            pthread_mutex_lock(&queue.lock);
+            --queue.readers;
+            pthread_mutex_unlock(&queue.lock);
+        }
+    }
+    pthread_attr_destroy(&detached);
+
+    /* Let requests in flight arrive, finish queued jobs, then stop */
+    pthread_mutex_lock(&queue.lock);
+    while (queue.readers)
+        pthread_cond_wait(&queue.cond, &queue.lock);
+    queue.stopping = 1;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+    for (int t=0 ; t<workerCount ; ++t)
+        pthread_join(threads[t], NULL);
+
+    close(lfd);
+    unlink(socketPath);
+    free(threads);
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.lock);
+
+    return 0;
+}
+
+/* Reports errors, or writes returned .dsp bytes to dspPath */
+static int ReceiveResponse(int fd, const char* socketPath, const char* dspPath)
+{
+    struct daemon_response resp;
+    if (ReadFull(fd, &resp, sizeof(resp)) || memcmp(resp.magic, DAEMON_RESPONSE_MAGIC, 4))
+    {
+        fprintf(stderr, "'%s' sent no response\n", socketPath);
+        return 1;
+    }
+
+    char* data = malloc(resp.dataSize + 1);
+    if (!data || ReadFull(fd, data, resp.dataSize))
+    {
+        fprintf(stderr, "'%s' sent a truncated response\n", socketPath);
+        free(data);
+        return 1;
+    }
+
+    int ret = 0;
+    if (resp.status)
+    {
+        data[resp.dataSize] = '\0';
+        fprintf(stderr, "%s\n", data);
+        ret = 1;
+    }
+    else if (resp.dataSize)
+    {
+        FILE* fout = fopen(dspPath, "wb");
+        if (!fout)
+        {
+            fprintf(stderr, "'%s' won't open - %s\n", dspPath, strerror(errno));
+            ret = 1;
+        }
+        else
+        {
+            fwrite(data, 1, resp.dataSize, fout);
+            fclose(fout);
+        }
+    }
+
+    free(data);
+    return ret;
+}
+
+int DaemonSubmit(const char* socketPath, const char* wavPath, const char* dspPath,
+                 uint32_t flags, const struct dsp_tuning* tuning, const struct dsp_loop* loop, int loopAlign)
+{
+    struct daemon_request req = {};
+    memcpy(req.magic, DAEMON_REQUEST_MAGIC, 4);
+    req.flags = flags;
+    req.loopAlign = loopAlign;
+    req.tuning = *tuning;
+    req.loop = *loop;
+
+    /* The daemon resolves paths from its own working directory */
+    char inPath[PATH_MAX] = "";
+    char outPath[PATH_MAX] = "";
+    struct clip_scratch scratch = {};
+    if (flags & DAEMON_INLINE)
+    {
+        struct wav_info wav;
+        ClipScratchInit(&scratch, 0);
+        if (ClipLoadWAV(wavPath, &scratch, &wav))
+        {
+            ClipScratchFree(&scratch);
+            return 1;
+        }
+        req.sampleRate = wav.sampleRate;
+        req.sampleCount = wav.sampleCount;
+        if (loop->end < 0)
+            req.loop = wav.loop;
+    }
+    else if (!(flags & DAEMON_SHUTDOWN))
+    {
+        if (!realpath(wavPath, inPath))
+        {
+            fprintf(stderr, "'%s' won't open - %s\n", wavPath, strerror(errno));
+            return 1;
+        }
+        if (dspPath[0] == '/')
+            snprintf(outPath, PATH_MAX, "%s", dspPath);
+        else if (getcwd(outPath, PATH_MAX))
+            snprintf(outPath + strlen(outPath), PATH_MAX - strlen(outPath), "/%s", dspPath);
+    }
+    req.inPathLen = strlen(inPath);
+    req.outPathLen = strlen(outPath);
+
+    int ret = 1;
+    struct sockaddr_un addr;
+    int fd = OpenSocket(socketPath, &addr);
+    if (fd >= 0)
+    {
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+            fprintf(stderr, "'%s' won't connect - %s\n", socketPath, strerror(errno));
+        else if (WriteFull(fd, &req, sizeof(req)) ||
+                 WriteFull(fd, inPath, req.inPathLen) ||
+                 WriteFull(fd, outPath, req.outPathLen) ||
+                 ((flags & DAEMON_INLINE) && WriteFull(fd, scratch.pcm, req.sampleCount * 2)))
+            fprintf(stderr, "'%s' dropped the request\n", socketPath);
+        else
+            ret = ReceiveResponse(fd, socketPath, dspPath);
+        close(fd);
+    }
+
+    if (flags & DAEMON_INLINE)
+        ClipScratchFree(&scratch);
+    return ret;
+}
@@ -0,0 +1,232 @@
+#ifndef DSPENC_H
+#define DSPENC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PACKET_NIBBLES 16
+#define PACKET_SAMPLES 14
+#define PACKET_BYTES 8
+
+/* Longest stream whose nibble count fits the 32-bit header fields */
+#define MAX_STREAM_SAMPLES ((int64_t)(UINT32_MAX / PACKET_NIBBLES) * PACKET_SAMPLES)
+
+/* Standard DSPADPCM header */
+struct dspadpcm_header
+{
+    uint32_t num_samples;
+    uint32_t num_nibbles;
+    uint32_t sample_rate;
+    uint16_t loop_flag;
+    uint16_t format; /* 0 for ADPCM */
+    uint32_t loop_start;
+    uint32_t loop_end;
+    uint32_t ca;
+    int16_t coef[16];
+    int16_t gain;
+    int16_t ps;
+    int16_t hist1;
+    int16_t hist2;
+    int16_t loop_ps;
+    int16_t loop_hist1;
+    int16_t loop_hist2;
+    uint16_t pad[11];
+};
+
+/* Sound bank file; all fields big-endian like the DSPADPCM header
+ * The bank header is followed by `count` table entries, then each clip's
+ * ADPCM payload starting on an `alignment` boundary from the file start.
+ */
+struct dspbank_header
+{
+    char magic[4]; /* 'DSPB' */
+    uint32_t version;
+    uint32_t count;
+    uint32_t alignment;
+};
+
+struct dspbank_entry
+{
+    uint32_t offset;
+    uint32_t size;
+    struct dspadpcm_header header;
+};
+
+#define DSPBANK_VERSION 1
+
+/* Scale search strategies */
+#define SCALE_SEARCH_RETRY 0  /* Raise the estimated scale until the residual fits */
+#define SCALE_SEARCH_SINGLE 1 /* Keep the estimated scale */
+#define SCALE_SEARCH_FULL 2   /* Try every scale and keep the least error */
+
+/* Encoder speed/quality knobs */
+struct dsp_tuning
+{
+    int chunkPackets;       /* Correlator analysis chunk; doesn't change the output */
+    double recordThreshold; /* Least frame energy that yields a correlation record */
+    int kmeansPasses;       /* Refinement passes per coef split */
+    int splitLevels;        /* 1-3 splits for 2, 4 or 8 distinct coef sets */
+    int scaleSearch;        /* SCALE_SEARCH_* */
+    int candidates;         /* Coef sets fully searched per packet (1-8) */
+};
+
+struct dsp_preset
+{
+    const char* name;
+    const struct dsp_tuning* tuning;
+};
+
+/* Loop points in samples, end inclusive like the header and smpl chunks;
+ * end < 0 for no loop */
+struct dsp_loop
+{
+    int64_t start;
+    int64_t end;
+};
+
+#define LOOP_ALIGN_NONE 0
+#define LOOP_ALIGN_PAD 1    /* Lead with silence so the loop starts on a packet */
+#define LOOP_ALIGN_UNROLL 2 /* Repeat the loop head past its end, moving both points onto a packet */
+
+/* bank.c */
+int BankEncode(const char* bankPath, char** clipPaths, int clipCount, int threadCount,
+               const struct dsp_tuning* tuning, uint32_t alignment, int loopAlign);
+
+/* bench.c */
+int BenchRun(char** wavPaths, int wavCount);
+
+/* header.c */
+int64_t GetNibbleFromSample(int64_t samples);
+int64_t GetNibbleAddress(int64_t sample);
+int64_t GetBytesForAdpcmSamples(int64_t samples);
+uint32_t DSPBig32(uint32_t v);
+void DSPGetHeaderCoefs(const struct dspadpcm_header* header, short coefsOut[16]);
+void DSPInitHeader(struct dspadpcm_header* header, int64_t samplecount, uint32_t samplerate,
+                   const short coefs[16]);
+void DSPSetHeaderPs(struct dspadpcm_header* header, const unsigned char* adpcm);
+void DSPSetHeaderLoop(struct dspadpcm_header* header, const struct dsp_loop* loop,
+                      const unsigned char loopPacket[8], const short hist[2], const short coefs[8][2]);
+
+/* clip.c */
+struct wav_info;
+struct clip_scratch
+{
+    struct dsp_correlator* correlator;
+    int16_t* pcm;
+    int64_t pcmCap;
+};
+
+void ClipScratchInit(struct clip_scratch* scratch, int64_t samples);
+void ClipScratchFree(struct clip_scratch* scratch);
+int16_t* ClipScratchReserve(struct clip_scratch* scratch, int64_t samples);
+int ClipLoadWAV(const char* path, struct clip_scratch* scratch, struct wav_info* wav);
+int ClipApplyLoop(struct clip_scratch* scratch, int64_t* samples, const struct dsp_loop* loop, int align,
+                  const char* name, struct dsp_loop* loopOut);
+void ClipEncode(const int16_t* pcm, int64_t samples, uint32_t sampleRate, struct clip_scratch* scratch,
+                const struct dsp_tuning* tuning, const struct dsp_loop* loop,
+                struct dspadpcm_header* headerOut, unsigned char* adpcmOut);
+
+/* daemon.c */
+#define DAEMON_INLINE 0x1   /* PCM travels with the request, .dsp bytes with the reply */
+#define DAEMON_BATCH 0x2    /* Yield to interactive jobs */
+#define DAEMON_SHUTDOWN 0x4 /* Finish queued jobs and exit */
+
+int DaemonServe(const char* socketPath, int threadCount);
+int DaemonSubmit(const char* socketPath, const char* wavPath, const char* dspPath,
+                 uint32_t flags, const struct dsp_tuning* tuning, const struct dsp_loop* loop, int loopAlign);
+
+/* grok.c */
+struct dsp_correlator;
+struct dsp_correlator* DSPCorrelatorCreate(const struct dsp_tuning* tuning);
+void DSPCorrelatorReset(struct dsp_correlator* c, const struct dsp_tuning* tuning);
+void DSPCorrelatorFree(struct dsp_correlator* c);
+void DSPCorrelateFeed(struct dsp_correlator* c, const short* source, int64_t samples);
+void DSPCorrelateFinish(struct dsp_correlator* c, short* coefsOut);
+
+void DSPCorrelateCoefs(const short* source, int64_t samples, short* coefsOut);
+void DSPEncodeFrame(short pcmInOut[16], int sampleCount, unsigned char adpcmOut[8], const short coefsIn[8][2]);
+void DSPEncodeFrameTuned(short pcmInOut[16], int sampleCount, unsigned char adpcmOut[8], const short coefsIn[8][2],
+                         const struct dsp_tuning* tuning);
+void DSPEncodeBuffer(const short* source, int64_t samples, const short coefsIn[8][2], short hist[2],
+                     unsigned char* adpcmOut, const struct dsp_tuning* tuning);
+void DSPDecodeFrame(const unsigned char adpcmIn[8], int sampleCount, short hist[2], const short coefsIn[8][2],
+                    short pcmOut[14]);
+
+/* incremental.c */
+struct dsp_sidecar;
+void MakeSidecarPath(char* pathOut, size_t pathSz, const char* dspPath);
+struct dsp_sidecar* SidecarOpen(const char* dspPath, const struct dsp_tuning* tuning);
+void SidecarAppend(struct dsp_sidecar* sc, const int16_t* pcm, int64_t samples,
+                   const unsigned char* adpcm, const short coefs[8][2]);
+void SidecarClose(struct dsp_sidecar* sc);
+int IncrementalEncode(const char* wavPath, const char* dspPath, const struct dsp_tuning* tuning,
+                      const struct dsp_loop* loop, int loopAlign, int verify);
+
+/* loop.c */
+/* Maps stream positions onto source samples: [0, pad) is silence,
+ * [pad, wrapAt) reads the source from `first` and [wrapAt, samples) reads
+ * it again from `wrapTo` */
+struct stream_layout
+{
+    int64_t first;
+    int64_t pad;
+    int64_t wrapAt;
+    int64_t wrapTo;
+    int64_t samples;
+    struct dsp_loop loop; /* In stream positions */
+};
+
+void LoopLayoutInit(struct stream_layout* layout, int64_t first, int64_t samples);
+int LoopLayoutApply(struct stream_layout* layout, const struct dsp_loop* loop, int align, const char* name);
+int64_t LoopReadSamples(FILE* fin, const struct wav_info* wav, const struct stream_layout* layout,
+                        int64_t pos, int16_t* buf, int64_t count);
+void LoopArrange(const struct stream_layout* layout, int16_t* pcm);
+int LoopParse(const char* arg, struct dsp_loop* loop);
+
+/* parallel.c */
+int64_t DSPEncodeParallel(const short* source, int64_t samples, const short coefsIn[8][2], short hist[2],
+                          unsigned char* adpcmOut, short* reconOut, int threadCount,
+                          const struct dsp_tuning* tuning);
+
+/* preset.c */
+extern const struct dsp_preset DSP_PRESETS[];
+const struct dsp_tuning* DSPDefaultTuning();
+const struct dsp_tuning* DSPFindPreset(const char* name);
+int DSPTuningValid(const struct dsp_tuning* tuning);
+
+/* trace.c */
+struct trace_span
+{
+    const char* name;
+    double start;
+};
+
+int TraceOpen(const char* path);
+void TraceClose();
+void TraceSetThreadName(const char* name);
+void TraceBegin(struct trace_span* span, const char* name);
+void TraceEnd(struct trace_span* span, int64_t bytes, int64_t samples);
+double GetSeconds();
+
+/* verify.c */
+struct dsp_verifier;
+struct dsp_verifier* VerifyStart(const short coefs[8][2]);
+void VerifySubmit(struct dsp_verifier* v, const int16_t* pcm, const short* recon,
+                  const unsigned char* adpcm, int64_t samples);
+int VerifyFinish(struct dsp_verifier* v);
+double GetSNR(double signal, double noise);
+
+/* wav.c */
+struct wav_info
+{
+    uint32_t sampleRate;
+    int64_t sampleCount;
+    int64_t dataOffset;
+    struct dsp_loop loop; /* First smpl loop, if any */
+};
+
+FILE* WAVOpen(const char* path, struct wav_info* info);
+int WAVSeekSample(FILE* fin, const struct wav_info* info, int64_t sample);
+int64_t WAVReadSamples(FILE* fin, int16_t* buf, int64_t count);
+
+#endif
@@ -4,8 +4,23 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += main.c \
-    grok.c
+    bank.c \
+    bench.c \
+    clip.c \
+    daemon.c \
+    grok.c \
+    header.c \
+    incremental.c \
+    loop.c \
+    parallel.c \
+    preset.c \
+    trace.c \
+    verify.c \
+    wav.c
 linux:LIBS += -lasound
+unix:LIBS += -lpthread -lm
+
+HEADERS += dspenc.h
 
 DISTFILES += \
     README.md
@@ -4,6 +4,7 @@
 #include <float.h>
 #include <string.h>
 #include <limits.h>
+#include "dspenc.h"
 
 /* Reference:
  * https://code.google.com/p/brawltools/source/browse/trunk/BrawlLib/Wii/Audio/AudioConverter.cs
@@ -243,17 +244,17 @@ static double ContrastVectors(tvec source1, tvec source2)
     return val1 + (2.0 * val * val2) + (2.0 * (-source2[1] * val + -source2[2]) * val3);
 }
 
-static void FilterRecords(tvec vecBest[8], int exp, tvec records[], int recordCount)
+static void FilterRecords(tvec vecBest[8], int exp, tvec records[], size_t recordCount, int passes)
 {
     tvec bufferList[8];
 
-    int buffer1[8];
+    size_t buffer1[8];
     tvec buffer2;
 
     int index;
     double value, tempVal = 0;
 
-    for (int x=0 ; x<2 ; x++)
+    for (int x=0 ; x<passes ; x++)
     {
         for (int y=0 ; y<exp ; y++)
         {
@@ -261,7 +262,7 @@ static void FilterRecords(tvec vecBest[8], int exp, tvec records[], int recordCo
             for (int i=0 ; i<=2 ; i++)
                 bufferList[y][i] = 0.0;
         }
-        for (int z=0 ; z<recordCount ; z++)
+        for (size_t z=0 ; z<recordCount ; z++)
         {
             index = 0;
             value= 1.0e30;
@@ -290,76 +291,150 @@ static void FilterRecords(tvec vecBest[8], int exp, tvec records[], int recordCo
     }
 }
 
-void DSPCorrelateCoefs(const short* source, int samples, short* coefsOut)
+/* Streaming correlator state
+ * PCM is gathered into analysis chunks of whole packets so that arbitrarily
+ * long sources may be fed in pieces; the chunk size only affects throughput.
+ * Records and the chunk buffer persist across Reset for reuse.
+ */
+struct dsp_correlator
+{
+    struct dsp_tuning tuning;
+    short* blockBuffer;
+    int blockCap;
+    int blockSamples;
+    short pcmHistBuffer[2][14];
+
+    tvec* records;
+    size_t recordCount;
+    size_t recordCap;
+};
+
+struct dsp_correlator* DSPCorrelatorCreate(const struct dsp_tuning* tuning)
 {
-    int numFrames = (samples + 13) / 14;
-    int frameSamples;
+    struct dsp_correlator* c = (struct dsp_correlator*)calloc(sizeof(struct dsp_correlator), 1);
+    DSPCorrelatorReset(c, tuning);
+    return c;
+}
 
-    short* blockBuffer = (short*)calloc(sizeof(short), 0x3800);
-    short pcmHistBuffer[2][14] = {};
+void DSPCorrelatorReset(struct dsp_correlator* c, const struct dsp_tuning* tuning)
+{
+    c->tuning = *tuning;
+    if (tuning->chunkPackets * PACKET_SAMPLES > c->blockCap)
+    {
+        c->blockCap = tuning->chunkPackets * PACKET_SAMPLES;
+        c->blockBuffer = (short*)realloc(c->blockBuffer, c->blockCap * sizeof(short));
+    }
 
-    tvec vec1;
-    tvec vec2;
+    c->blockSamples = 0;
+    memset(c->pcmHistBuffer, 0, sizeof(c->pcmHistBuffer));
+    c->recordCount = 0;
+}
+
+void DSPCorrelatorFree(struct dsp_correlator* c)
+{
+    free(c->blockBuffer);
+    free(c->records);
+    free(c);
+}
 
+static void CorrelateFrame(struct dsp_correlator* c, int frameSamples)
+{
+    tvec vec1;
     tvec mtx[3];
     int vecIdxs[3];
 
-    tvec* records = (tvec*)calloc(sizeof(tvec), numFrames * 2);
-    int recordCount = 0;
-
-    tvec vecBest[8];
-
-    /* Iterate though 1024-block frames */
-    for (int x=samples ; x>0 ;)
+    for (int i=0 ; i<frameSamples ;)
     {
-        if (x > 0x3800) /* Full 1024-block frame */
-        {
-            frameSamples = 0x3800;
-            x -= 0x3800;
-        }
-        else /* Partial frame */
-        {
-            /* Zero lingering block samples */
-            frameSamples = x;
-            for (int z=0 ; z<14 && z+frameSamples<0x3800 ; z++)
-                blockBuffer[frameSamples+z] = 0;
-            x = 0;
-        }
-
-        /* Copy (potentially non-frame-aligned PCM samples into aligned buffer) */
-        memcpy(blockBuffer, source, frameSamples * sizeof(short));
-        source += frameSamples;
+        for (int z=0 ; z<14 ; z++)
+            c->pcmHistBuffer[0][z] = c->pcmHistBuffer[1][z];
+        for (int z=0 ; z<14 ; z++)
+            c->pcmHistBuffer[1][z] = c->blockBuffer[i++];
 
-
-        for (int i=0 ; i<frameSamples ;)
+        InnerProductMerge(vec1, c->pcmHistBuffer[1]);
+        if (fabs(vec1[0]) > c->tuning.recordThreshold)
         {
-            for (int z=0 ; z<14 ; z++)
-                pcmHistBuffer[0][z] = pcmHistBuffer[1][z];
-            for (int z=0 ; z<14 ; z++)
-                pcmHistBuffer[1][z] = blockBuffer[i++];
-
-            InnerProductMerge(vec1, pcmHistBuffer[1]);
-            if (fabs(vec1[0]) > 10.0)
+            OuterProductMerge(mtx, c->pcmHistBuffer[1]);
+            if (!AnalyzeRanges(mtx, vecIdxs))
             {
-                OuterProductMerge(mtx, pcmHistBuffer[1]);
-                if (!AnalyzeRanges(mtx, vecIdxs))
+                BidirectionalFilter(mtx, vecIdxs, vec1);
+                if (!QuadraticMerge(vec1))
                 {
-                    BidirectionalFilter(mtx, vecIdxs, vec1);
-                    if (!QuadraticMerge(vec1))
+                    if (c->recordCount == c->recordCap)
                     {
-                        FinishRecord(vec1, records[recordCount]);
-                        recordCount++;
+                        c->recordCap = c->recordCap ? c->recordCap * 2 : 1024;
+                        c->records = (tvec*)realloc(c->records, sizeof(tvec) * c->recordCap);
                     }
+                    FinishRecord(vec1, c->records[c->recordCount]);
+                    c->recordCount++;
                 }
             }
         }
     }
+}
+
+void DSPCorrelateFeed(struct dsp_correlator* c, const short* source, int64_t samples)
+{
+    struct trace_span span;
+    TraceBegin(&span, "extract records");
+    int64_t fedSamples = samples;
+    int chunkSamples = c->tuning.chunkPackets * PACKET_SAMPLES;
+
+    /* Iterate though analysis chunks */
+    while (samples > 0)
+    {
+        /* Copy (potentially non-frame-aligned PCM samples into aligned buffer) */
+        int frameSamples = (int)MIN(chunkSamples - c->blockSamples, samples);
+        memcpy(c->blockBuffer + c->blockSamples, source, frameSamples * sizeof(short));
+        c->blockSamples += frameSamples;
+        source += frameSamples;
+        samples -= frameSamples;
+
+        /* Full chunk */
+        if (c->blockSamples == chunkSamples)
+        {
+            CorrelateFrame(c, chunkSamples);
+            c->blockSamples = 0;
+        }
+    }
+
+    TraceEnd(&span, fedSamples * sizeof(short), fedSamples);
+}
+
+void DSPCorrelateFinish(struct dsp_correlator* c, short* coefsOut)
+{
+    tvec vec1;
+    tvec vec2;
+
+    tvec vecBest[8];
+
+    tvec* records;
+    size_t recordCount;
+
+    struct trace_span span;
+    static const char* splitNames[3] = {"filter records 2", "filter records 4", "filter records 8"};
+
+    /* Partial frame */
+    if (c->blockSamples)
+    {
+        TraceBegin(&span, "extract records");
+        int frameSamples = c->blockSamples;
+
+        /* Zero lingering block samples */
+        for (int z=0 ; z<14 && z+c->blockSamples<c->tuning.chunkPackets*PACKET_SAMPLES ; z++)
+            c->blockBuffer[c->blockSamples+z] = 0;
+        CorrelateFrame(c, c->blockSamples);
+        c->blockSamples = 0;
+
+        TraceEnd(&span, frameSamples * sizeof(short), frameSamples);
+    }
+    records = c->records;
+    recordCount = c->recordCount;
 
     vec1[0] = 1.0;
     vec1[1] = 0.0;
     vec1[2] = 0.0;
 
-    for (int z=0 ; z<recordCount ; z++)
+    for (size_t z=0 ; z<recordCount ; z++)
     {
         MatrixFilter(records[z], vecBest[0]);
         for (int y=1 ; y<=2 ; y++)
@@ -372,7 +447,7 @@ void DSPCorrelateCoefs(const short* source, int samples, short* coefsOut)
 
 
     int exp = 1;
-    for (int w=0 ; w<3 ;)
+    for (int w=0 ; w<c->tuning.splitLevels ;)
     {
         vec2[0] = 0.0;
         vec2[1] = -1.0;
@@ -382,9 +457,15 @@ void DSPCorrelateCoefs(const short* source, int samples, short* coefsOut)
                 vecBest[exp+i][y] = (0.01 * vec2[y]) + vecBest[i][y];
         ++w;
         exp = 1 << w;
-        FilterRecords(vecBest, exp, records, recordCount);
+        TraceBegin(&span, splitNames[w-1]);
+        FilterRecords(vecBest, exp, records, recordCount, c->tuning.kmeansPasses);
+        TraceEnd(&span, recordCount * sizeof(tvec), 0);
     }
 
+    /* Fewer splits repeat the distinct sets across all 8 slots */
+    for (int z=exp ; z<8 ; z++)
+        memcpy(vecBest[z], vecBest[z-exp], sizeof(tvec));
+
     /* Write output */
     for (int z=0 ; z<8 ; z++)
     {
@@ -401,15 +482,73 @@ void DSPCorrelateCoefs(const short* source, int samples, short* coefsOut)
         else
             coefsOut[z*2+1] = (d < -32768.0) ? (short)-32768 : (short)lround(d);
     }
+}
+
+void DSPCorrelateCoefs(const short* source, int64_t samples, short* coefsOut)
+{
+    struct dsp_correlator* c = DSPCorrelatorCreate(DSPDefaultTuning());
+    DSPCorrelateFeed(c, source, samples);
+    DSPCorrelateFinish(c, coefsOut);
 
     /* Free memory */
-    free(records);
-    free(blockBuffer);
+    DSPCorrelatorFree(c);
+}
+
+/* Quantize the packet with one coef set at one scale
+ * inSamples must hold the yn values; it receives the reconstruction and
+ * outSamples the nibbles. Returns the squared error, with the largest
+ * nibble overflow in overflowOut. */
+static double EncodeScale(const short pcmInOut[16], int sampleCount, const short coefs[2], int scale,
+                          int inSamples[16], int outSamples[14], int* overflowOut)
+{
+    int v1, v2, v3;
+    int index = 0;
+    double distAccum = 0;
 
+    for (int s=0 ; s<sampleCount ; s++)
+    {
+        /* Multiply previous */
+        v1 = ((inSamples[s] * coefs[1]) + (inSamples[s + 1] * coefs[0]));
+        /* Evaluate from real sample */
+        v2 = ((pcmInOut[s + 2] << 11) - v1) / 2048;
+        /* Round to nearest sample */
+        v3 = (v2 > 0) ? (int)((double)v2 / (1 << scale) + 0.4999999f) : (int)((double)v2 / (1 << scale) - 0.4999999f);
+
+        /* Clamp sample and set index */
+        if (v3 < -8)
+        {
+            if (index < (v3 = -8 - v3))
+                index = v3;
+            v3 = -8;
+        }
+        else if (v3 > 7)
+        {
+            if (index < (v3 -= 7))
+                index = v3;
+            v3 = 7;
+        }
+
+        /* Store result */
+        outSamples[s] = v3;
+
+        /* Round and expand */
+        v1 = (v1 + ((v3 * (1 << scale)) << 11) + 1024) >> 11;
+        /* Clamp and store */
+        inSamples[s + 2] = v2 = (v1 >= 32767) ? 32767 : (v1 <= -32768) ? -32768 : v1;
+        /* Accumulate distance */
+        v3 = pcmInOut[s + 2] - v2;
+        distAccum += v3 * (double)v3;
+    }
+
+    *overflowOut = index;
+    return distAccum;
 }
 
-/* Make sure source includes the yn values (16 samples total) */
-void DSPEncodeFrame(short pcmInOut[16], int sampleCount, unsigned char adpcmOut[8], const short coefsIn[8][2])
+/* Make sure source includes the yn values (16 samples total)
+ * Only the tuning's `candidates` distinct coef sets with the smallest peak
+ * prediction residual go through the scale search */
+void DSPEncodeFrameTuned(short pcmInOut[16], int sampleCount, unsigned char adpcmOut[8], const short coefsIn[8][2],
+                         const struct dsp_tuning* tuning)
 {
     int inSamples[8][16];
     int outSamples[8][14];
@@ -418,19 +557,26 @@ void DSPEncodeFrame(short pcmInOut[16], int sampleCount, unsigned char adpcmOut[
 
     int scale[8];
     double distAccum[8];
+    int distance[8];
+    bool selected[8];
 
-    /* Iterate through each coef set, finding the set with the smallest error */
+    /* Prescreen each coef set by its peak prediction residual */
     for (int i=0 ; i<8 ; i++)
     {
         int v1, v2, v3;
-        int distance, index;
 
         /* Set yn values */
         inSamples[i][0] = pcmInOut[0];
         inSamples[i][1] = pcmInOut[1];
 
+        /* Repeated sets can't beat their first occurrence */
+        selected[i] = true;
+        for (int j=0 ; j<i && selected[i] ; j++)
+            if (coefsIn[j][0] == coefsIn[i][0] && coefsIn[j][1] == coefsIn[i][1])
+                selected[i] = false;
+
         /* Round and clamp samples for this coef set */
-        distance = 0;
+        distance[i] = 0;
         for (int s=0 ; s<sampleCount ; s++)
         {
             /* Multiply previous samples by coefs */
@@ -440,54 +586,72 @@ void DSPEncodeFrame(short pcmInOut[16], int sampleCount, unsigned char adpcmOut[
             /* Clamp */
             v3 = (v2 >= 32767) ? 32767 : (v2 <= -32768) ? -32768 : v2;
             /* Compare distance */
-            if (abs(v3) > abs(distance))
-                distance = v3;
+            if (abs(v3) > abs(distance[i]))
+                distance[i] = v3;
         }
+    }
 
-        /* Set initial scale */
-        for (scale[i]=0; (scale[i]<=12) && ((distance>7) || (distance<-8)); scale[i]++, distance/=2) {}
-        scale[i] = (scale[i] <= 1) ? -1 : scale[i] - 2;
+    /* Keep only the candidates with the smallest peaks (ties go to lower indices) */
+    if (tuning->candidates < 8)
+    {
+        bool distinct[8];
+        memcpy(distinct, selected, sizeof(distinct));
+        for (int i=0 ; i<8 ; i++)
+        {
+            if (!distinct[i])
+                continue;
+            int rank = 0;
+            for (int j=0 ; j<8 ; j++)
+                if (distinct[j] &&
+                    (abs(distance[j]) < abs(distance[i]) || (abs(distance[j]) == abs(distance[i]) && j < i)))
+                    rank++;
+            selected[i] = rank < tuning->candidates;
+        }
+    }
 
-        do
+    /* Iterate through each candidate coef set, finding the set with the smallest error */
+    for (int i=0 ; i<8 ; i++)
+    {
+        int index;
+
+        if (!selected[i])
         {
-            scale[i]++;
-            distAccum[i] = 0;
-            index = 0;
+            distAccum[i] = DBL_MAX;
+            continue;
+        }
 
-            for (int s=0 ; s<sampleCount ; s++)
+        /* Every scale, keeping the one with the least error */
+        if (tuning->scaleSearch == SCALE_SEARCH_FULL)
+        {
+            int trialIn[16], trialOut[14];
+            trialIn[0] = inSamples[i][0];
+            trialIn[1] = inSamples[i][1];
+            distAccum[i] = DBL_MAX;
+            for (int trial=0 ; trial<=12 ; trial++)
             {
-                /* Multiply previous */
-                v1 = ((inSamples[i][s] * coefsIn[i][1]) + (inSamples[i][s + 1] * coefsIn[i][0]));
-                /* Evaluate from real sample */
-                v2 = ((pcmInOut[s + 2] << 11) - v1) / 2048;
-                /* Round to nearest sample */
-                v3 = (v2 > 0) ? (int)((double)v2 / (1 << scale[i]) + 0.4999999f) : (int)((double)v2 / (1 << scale[i]) - 0.4999999f);
-
-                /* Clamp sample and set index */
-                if (v3 < -8)
+                double dist = EncodeScale(pcmInOut, sampleCount, coefsIn[i], trial, trialIn, trialOut, &index);
+                if (dist < distAccum[i])
                 {
-                    if (index < (v3 = -8 - v3))
-                        index = v3;
-                    v3 = -8;
-                }
-                else if (v3 > 7)
-                {
-                    if (index < (v3 -= 7))
-                        index = v3;
-                    v3 = 7;
+                    distAccum[i] = dist;
+                    scale[i] = trial;
+                    memcpy(inSamples[i] + 2, trialIn + 2, sampleCount * sizeof(int));
+                    memcpy(outSamples[i], trialOut, sampleCount * sizeof(int));
                 }
+            }
+            continue;
+        }
 
-                /* Store result */
-                outSamples[i][s] = v3;
+        /* Set initial scale */
+        for (scale[i]=0; (scale[i]<=12) && ((distance[i]>7) || (distance[i]<-8)); scale[i]++, distance[i]/=2) {}
+        scale[i] = (scale[i] <= 1) ? -1 : scale[i] - 2;
 
-                /* Round and expand */
-                v1 = (v1 + ((v3 * (1 << scale[i])) << 11) + 1024) >> 11;
-                /* Clamp and store */
-                inSamples[i][s + 2] = v2 = (v1 >= 32767) ? 32767 : (v1 <= -32768) ? -32768 : v1;
-                /* Accumulate distance */
-                v3 = pcmInOut[s + 2] - v2;
-                distAccum[i] += v3 * (double)v3;
-            }
+        do
+        {
+            scale[i]++;
+            distAccum[i] = EncodeScale(pcmInOut, sampleCount, coefsIn[i], scale[i],
+                                       inSamples[i], outSamples[i], &index);
+            if (tuning->scaleSearch == SCALE_SEARCH_SINGLE)
+                break;
 
             for (int x=index+8 ; x>256 ; x>>=1)
                 if (++scale[i] >= 12)
@@ -523,3 +687,61 @@ void DSPEncodeFrame(short pcmInOut[16], int sampleCount, unsigned char adpcmOut[
         adpcmOut[y + 1] = (char)((outSamples[bestIndex][y * 2] << 4) | (outSamples[bestIndex][y * 2 + 1] & 0xF));
     }
 }
+
+void DSPEncodeFrame(short pcmInOut[16], int sampleCount, unsigned char adpcmOut[8], const short coefsIn[8][2])
+{
+    DSPEncodeFrameTuned(pcmInOut, sampleCount, adpcmOut, coefsIn, DSPDefaultTuning());
+}
+
+/* Serially encode a whole buffer, continuing from and updating hist */
+void DSPEncodeBuffer(const short* source, int64_t samples, const short coefsIn[8][2], short hist[2],
+                     unsigned char* adpcmOut, const struct dsp_tuning* tuning)
+{
+    short convSamps[16];
+    convSamps[0] = hist[0];
+    convSamps[1] = hist[1];
+
+    for (int64_t p=0 ; p*PACKET_SAMPLES<samples ; ++p)
+    {
+        int numSamples = (int)MIN(samples - p * PACKET_SAMPLES, PACKET_SAMPLES);
+        memset(convSamps + 2, 0, PACKET_SAMPLES * sizeof(short));
+        memcpy(convSamps + 2, source + p * PACKET_SAMPLES, numSamples * sizeof(short));
+
+        DSPEncodeFrameTuned(convSamps, PACKET_SAMPLES, adpcmOut + p * PACKET_BYTES, coefsIn, tuning);
+
+        convSamps[0] = convSamps[14];
+        convSamps[1] = convSamps[15];
+    }
+
+    hist[0] = convSamps[0];
+    hist[1] = convSamps[1];
+}
+
+/* Decode one packet, continuing from and updating hist (hist[1] most recent)
+ * Mirrors the encoder's reconstruction exactly */
+void DSPDecodeFrame(const unsigned char adpcmIn[8], int sampleCount, short hist[2], const short coefsIn[8][2],
+                    short pcmOut[14])
+{
+    int index = (adpcmIn[0] >> 4) & 0x7;
+    int scale = adpcmIn[0] & 0xF;
+
+    for (int s=0 ; s<sampleCount ; s++)
+    {
+        int v1, v2, v3;
+
+        /* Sign-extend nibble */
+        v3 = (s & 1) ? (adpcmIn[1 + s / 2] & 0xF) : (adpcmIn[1 + s / 2] >> 4);
+        if (v3 >= 8)
+            v3 -= 16;
+
+        /* Multiply previous */
+        v1 = (hist[0] * coefsIn[index][1]) + (hist[1] * coefsIn[index][0]);
+        /* Round and expand */
+        v1 = (v1 + ((v3 * (1 << scale)) << 11) + 1024) >> 11;
+        /* Clamp and store */
+        pcmOut[s] = v2 = (v1 >= 32767) ? 32767 : (v1 <= -32768) ? -32768 : v1;
+
+        hist[0] = hist[1];
+        hist[1] = v2;
+    }
+}
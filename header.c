@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <string.h>
+#include "dspenc.h"
+
+int64_t GetNibbleFromSample(int64_t samples)
+{
+    int64_t packets = samples / PACKET_SAMPLES;
+    int extraSamples = samples % PACKET_SAMPLES;
+    int extraNibbles = extraSamples == 0 ? 0 : extraSamples + 2;
+
+    return PACKET_NIBBLES * packets + extraNibbles;
+}
+
+int64_t GetNibbleAddress(int64_t sample)
+{
+    int64_t packets = sample / PACKET_SAMPLES;
+    int extraSamples = sample % PACKET_SAMPLES;
+
+    return PACKET_NIBBLES * packets + extraSamples + 2;
+}
+
+int64_t GetBytesForAdpcmSamples(int64_t samples)
+{
+    int extraBytes = 0;
+    int64_t packets = samples / PACKET_SAMPLES;
+    int extraSamples = samples % PACKET_SAMPLES;
+
+    if (extraSamples != 0)
+    {
+        extraBytes = (extraSamples / 2) + (extraSamples % 2) + 1;
+    }
+
+    return PACKET_BYTES * packets + extraBytes;
+}
+
+/* Header and bank fields are big-endian; converts either way */
+uint32_t DSPBig32(uint32_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return v;
+#else
+    return __builtin_bswap32(v);
+#endif
+}
+
+/* Host-order coefs out of a header */
+void DSPGetHeaderCoefs(const struct dspadpcm_header* header, short coefsOut[16])
+{
+    for (int i=0 ; i<16 ; ++i)
+    {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        coefsOut[i] = header->coef[i];
+#else
+        coefsOut[i] = __builtin_bswap16(header->coef[i]);
+#endif
+    }
+}
+
+/* Fill a big-endian header for a non-looping stream */
+void DSPInitHeader(struct dspadpcm_header* header, int64_t samplecount, uint32_t samplerate,
+                   const short coefs[16])
+{
+    memset(header, 0, sizeof(*header));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    header->num_samples = samplecount;
+    header->num_nibbles = GetNibbleFromSample(samplecount);
+    header->sample_rate = samplerate;
+    header->loop_start = GetNibbleAddress(0);
+    header->loop_end = GetNibbleAddress(samplecount - 1);
+    header->ca = GetNibbleAddress(0);
+    for (int i=0 ; i<16 ; ++i)
+        header->coef[i] = coefs[i];
+#else
+    header->num_samples = __builtin_bswap32(samplecount);
+    header->num_nibbles = __builtin_bswap32(GetNibbleFromSample(samplecount));
+    header->sample_rate = __builtin_bswap32(samplerate);
+    header->loop_start = __builtin_bswap32(GetNibbleAddress(0));
+    header->loop_end = __builtin_bswap32(GetNibbleAddress(samplecount - 1));
+    header->ca = __builtin_bswap32(GetNibbleAddress(0));
+    for (int i=0 ; i<16 ; ++i)
+        header->coef[i] = __builtin_bswap16(coefs[i]);
+#endif
+}
+
+/* Initial predictor/scale comes from the first packet */
+void DSPSetHeaderPs(struct dspadpcm_header* header, const unsigned char* adpcm)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    header->ps = adpcm[0];
+#else
+    header->ps = __builtin_bswap16(adpcm[0]);
+#endif
+}
+
+/* Loop context from the packet holding the loop start and the encoder's
+ * history entering it; only the packet's samples ahead of the start are
+ * decoded to reach the history at the start itself */
+void DSPSetHeaderLoop(struct dspadpcm_header* header, const struct dsp_loop* loop,
+                      const unsigned char loopPacket[8], const short hist[2], const short coefs[8][2])
+{
+    short yn[2] = {hist[0], hist[1]};
+    short pcmOut[PACKET_SAMPLES];
+    DSPDecodeFrame(loopPacket, loop->start % PACKET_SAMPLES, yn, coefs, pcmOut);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    header->loop_flag = 1;
+    header->loop_start = GetNibbleAddress(loop->start);
+    header->loop_end = GetNibbleAddress(loop->end);
+    header->loop_ps = loopPacket[0];
+    header->loop_hist1 = yn[1];
+    header->loop_hist2 = yn[0];
+#else
+    header->loop_flag = __builtin_bswap16(1);
+    header->loop_start = __builtin_bswap32(GetNibbleAddress(loop->start));
+    header->loop_end = __builtin_bswap32(GetNibbleAddress(loop->end));
+    header->loop_ps = __builtin_bswap16(loopPacket[0]);
+    header->loop_hist1 = __builtin_bswap16(yn[1]);
+    header->loop_hist2 = __builtin_bswap16(yn[0]);
+#endif
+}
@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "dspenc.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+/* Incremental re-encode
+ * A sidecar next to the .dsp records a source hash and the signal/noise
+ * energy of every packet. On the next encode, each packet is matched to a
+ * previous one by hash, following the alignment shift a whole-packet
+ * insertion or trim introduces. Packets without a match are re-encoded
+ * with the previous coefs, continuing past each edit until the
+ * reconstructed history converges back to the previous stream; from there
+ * the previous packets are reused as-is. A shift by a fraction of a packet
+ * moves every later packet boundary, so nothing after it matches.
+ */
+#define DSPINC_VERSION 1
+
+/* Re-encoded packets may lose this much SNR before the coefs are deemed stale */
+#define FIT_TOLERANCE_DB 3.0
+
+/* Fewer re-encoded packets than this say too little about the fit */
+#define FIT_MIN_PACKETS 64
+
+/* Past this share of unmatched packets, fresh coefs are worth a full encode */
+#define REWRITE_FRACTION 0.5
+
+/* Packets per chunk handed to the verifier */
+#define VERIFY_CHUNK_PACKETS 4096
+
+/* Sidecar file, host byte order */
+struct dspinc_header
+{
+    char magic[4]; /* 'DSPI' */
+    uint32_t version;
+    uint64_t sampleCount;
+    uint32_t candidates;
+    uint32_t scaleSearch;
+    double signal;
+    double noise;
+};
+
+struct dspinc_packet
+{
+    uint64_t hash;
+    float signal;
+    float noise;
+};
+
+struct dsp_sidecar
+{
+    FILE* f;
+    struct dspinc_header header;
+    short hist[2];
+};
+
+void MakeSidecarPath(char* pathOut, size_t pathSz, const char* dspPath)
+{
+    snprintf(pathOut, pathSz, "%s.inc", dspPath);
+}
+
+/* FNV-1a over the zero-padded packet */
+static uint64_t HashPacket(const int16_t* pcm, int64_t samples, int64_t p)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int s=0 ; s<PACKET_SAMPLES ; ++s)
+    {
+        int64_t i = p * PACKET_SAMPLES + s;
+        uint16_t v = i < samples ? (uint16_t)pcm[i] : 0;
+        hash = (hash ^ (v & 0xFF)) * 0x100000001B3ULL;
+        hash = (hash ^ (v >> 8)) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static void MeasurePacket(const int16_t* pcm, int64_t samples, int64_t p, const short recon[14],
+                          struct dspinc_packet* rec)
+{
+    double signal = 0.0, noise = 0.0;
+    int numSamples = (int)MIN(samples - p * PACKET_SAMPLES, PACKET_SAMPLES);
+
+    for (int s=0 ; s<numSamples ; ++s)
+    {
+        double src = pcm[p*PACKET_SAMPLES+s];
+        double err = src - recon[s];
+        signal += src * src;
+        noise += err * err;
+    }
+
+    rec->hash = HashPacket(pcm, samples, p);
+    rec->signal = (float)signal;
+    rec->noise = (float)noise;
+}
+
+struct dsp_sidecar* SidecarOpen(const char* dspPath, const struct dsp_tuning* tuning)
+{
+    char incPath[1024];
+    MakeSidecarPath(incPath, 1024, dspPath);
+
+    FILE* f = fopen(incPath, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "'%s' won't open - %s\n", incPath, strerror(errno));
+        return NULL;
+    }
+
+    struct dsp_sidecar* sc = calloc(sizeof(struct dsp_sidecar), 1);
+    sc->f = f;
+    memcpy(sc->header.magic, "DSPI", 4);
+    sc->header.version = DSPINC_VERSION;
+    sc->header.candidates = tuning->candidates;
+    sc->header.scaleSearch = tuning->scaleSearch;
+    fwrite(&sc->header, 1, sizeof(sc->header), f);
+    return sc;
+}
+
+/* Record a window of encoded packets; the window must start on a packet */
+void SidecarAppend(struct dsp_sidecar* sc, const int16_t* pcm, int64_t samples,
+                   const unsigned char* adpcm, const short coefs[8][2])
+{
+    short recon[14];
+    struct dspinc_packet rec;
+
+    for (int64_t p=0 ; p*PACKET_SAMPLES<samples ; ++p)
+    {
+        DSPDecodeFrame(adpcm + p * PACKET_BYTES, PACKET_SAMPLES, sc->hist, coefs, recon);
+        MeasurePacket(pcm, samples, p, recon, &rec);
+        fwrite(&rec, 1, sizeof(rec), sc->f);
+        sc->header.signal += rec.signal;
+        sc->header.noise += rec.noise;
+    }
+    sc->header.sampleCount += samples;
+}
+
+void SidecarClose(struct dsp_sidecar* sc)
+{
+    fseek(sc->f, 0, SEEK_SET);
+    fwrite(&sc->header, 1, sizeof(sc->header), sc->f);
+    fclose(sc->f);
+    free(sc);
+}
+
+/* Open-addressed map from packet hash to the first previous packet with it */
+struct packet_index
+{
+    int64_t* slots; /* -1 when empty */
+    uint64_t mask;
+};
+
+static void PacketIndexBuild(struct packet_index* index, const struct dspinc_packet* recs, int64_t packets)
+{
+    uint64_t size = 16;
+    while (size < (uint64_t)packets * 2)
+        size *= 2;
+    index->mask = size - 1;
+    index->slots = malloc(size * sizeof(int64_t));
+    memset(index->slots, 0xFF, size * sizeof(int64_t));
+
+    for (int64_t q=0 ; q<packets ; ++q)
+    {
+        uint64_t i = recs[q].hash & index->mask;
+        while (index->slots[i] >= 0 && recs[index->slots[i]].hash != recs[q].hash)
+            i = (i + 1) & index->mask;
+        if (index->slots[i] < 0)
+            index->slots[i] = q;
+    }
+}
+
+static int64_t PacketIndexFind(const struct packet_index* index, const struct dspinc_packet* recs, uint64_t hash)
+{
+    uint64_t i = hash & index->mask;
+    while (index->slots[i] >= 0)
+    {
+        if (recs[index->slots[i]].hash == hash)
+            return index->slots[i];
+        i = (i + 1) & index->mask;
+    }
+    return -1;
+}
+
+/* Previous stream and its sidecar, fully in memory */
+struct prev_stream
+{
+    int64_t samples;
+    int64_t packets;
+    short coefs[16];
+    unsigned char* blocks;
+    struct dspinc_header incHeader;
+    struct dspinc_packet* recs;
+};
+
+static int LoadPrevious(const char* dspPath, const struct dsp_tuning* tuning, struct prev_stream* prev)
+{
+    char incPath[1024];
+    MakeSidecarPath(incPath, 1024, dspPath);
+
+    FILE* fdsp = fopen(dspPath, "rb");
+    FILE* finc = fopen(incPath, "rb");
+    if (!fdsp || !finc)
+    {
+        printf("INCREMENTAL: no previous '%s' with sidecar, encoding in full\n", dspPath);
+        if (fdsp)
+            fclose(fdsp);
+        if (finc)
+            fclose(finc);
+        return 1;
+    }
+
+    struct dspadpcm_header header;
+    int ok = fread(&header, 1, sizeof(header), fdsp) == sizeof(header) &&
+             fread(&prev->incHeader, 1, sizeof(prev->incHeader), finc) == sizeof(prev->incHeader);
+
+    prev->samples = DSPBig32(header.num_samples);
+    prev->packets = prev->samples / PACKET_SAMPLES + (prev->samples % PACKET_SAMPLES != 0);
+    DSPGetHeaderCoefs(&header, prev->coefs);
+
+    ok = ok && !memcmp(prev->incHeader.magic, "DSPI", 4) &&
+         prev->incHeader.version == DSPINC_VERSION &&
+         prev->incHeader.sampleCount == (uint64_t)prev->samples &&
+         prev->incHeader.candidates == (uint32_t)tuning->candidates &&
+         prev->incHeader.scaleSearch == (uint32_t)tuning->scaleSearch;
+
+    if (ok)
+    {
+        prev->blocks = calloc(PACKET_BYTES, prev->packets);
+        prev->recs = calloc(sizeof(struct dspinc_packet), prev->packets);
+        int64_t bytes = GetBytesForAdpcmSamples(prev->samples);
+        ok = fread(prev->blocks, 1, bytes, fdsp) == (size_t)bytes &&
+             fread(prev->recs, sizeof(struct dspinc_packet), prev->packets, finc) == (size_t)prev->packets;
+    }
+
+    fclose(fdsp);
+    fclose(finc);
+
+    if (!ok)
+        printf("INCREMENTAL: '%s' doesn't match its sidecar or encode options, encoding in full\n", dspPath);
+    return !ok;
+}
+
+int IncrementalEncode(const char* wavPath, const char* dspPath, const struct dsp_tuning* tuning,
+                      const struct dsp_loop* loop, int loopAlign, int verify)
+{
+    struct prev_stream prev = {};
+    if (LoadPrevious(dspPath, tuning, &prev))
+    {
+        free(prev.blocks);
+        free(prev.recs);
+        return -1;
+    }
+    const short (*coefs)[2] = (const short(*)[2])prev.coefs;
+
+    struct clip_scratch scratch;
+    struct wav_info wav;
+    ClipScratchInit(&scratch, 0);
+    if (ClipLoadWAV(wavPath, &scratch, &wav))
+    {
+        ClipScratchFree(&scratch);
+        free(prev.blocks);
+        free(prev.recs);
+        return 1;
+    }
+    int64_t samples = wav.sampleCount;
+    struct dsp_loop streamLoop;
+    if (ClipApplyLoop(&scratch, &samples, loop->end >= 0 ? loop : &wav.loop, loopAlign, wavPath, &streamLoop))
+    {
+        ClipScratchFree(&scratch);
+        free(prev.blocks);
+        free(prev.recs);
+        return 1;
+    }
+    const int16_t* pcm = scratch.pcm;
+    int64_t packets = samples / PACKET_SAMPLES + (samples % PACKET_SAMPLES != 0);
+
+    /* History entering each previous packet */
+    short (*histBefore)[2] = calloc(sizeof(short[2]), prev.packets + 1);
+    short hist[2] = {0};
+    short recon[16];
+    for (int64_t p=0 ; p<prev.packets ; ++p)
+    {
+        DSPDecodeFrame(prev.blocks + p * PACKET_BYTES, PACKET_SAMPLES, hist, coefs, recon);
+        histBefore[p+1][0] = hist[0];
+        histBefore[p+1][1] = hist[1];
+    }
+
+    /* Previous packet each new one repeats, or -1; a partial final packet
+     * keeps only its leading nibbles on disk, so it only stands in for a
+     * final packet of the same length */
+    int64_t* match = malloc(sizeof(int64_t) * packets);
+    struct packet_index index;
+    PacketIndexBuild(&index, prev.recs, prev.packets);
+    int64_t prevTail = prev.samples % PACKET_SAMPLES ? prev.packets - 1 : -1;
+    int tailFits = samples % PACKET_SAMPLES == prev.samples % PACKET_SAMPLES;
+    int64_t shift = 0, unmatched = 0;
+    for (int64_t p=0 ; p<packets ; ++p)
+    {
+        uint64_t hash = HashPacket(pcm, samples, p);
+        int64_t q = p - shift;
+        if (q < 0 || q >= prev.packets || prev.recs[q].hash != hash)
+            q = PacketIndexFind(&index, prev.recs, hash);
+        if (q >= 0 && q == prevTail && !(p == packets - 1 && tailFits))
+            q = -1;
+        if (q >= 0)
+            shift = p - q;
+        else
+            ++unmatched;
+        match[p] = q;
+    }
+    free(index.slots);
+
+    if (unmatched > packets * REWRITE_FRACTION)
+    {
+        printf("INCREMENTAL: %" PRId64 " of %" PRId64 " packets changed, encoding in full\n", unmatched, packets);
+        free(match);
+        free(histBefore);
+        free(prev.blocks);
+        free(prev.recs);
+        ClipScratchFree(&scratch);
+        return -1;
+    }
+
+    unsigned char* blocks = malloc(packets * PACKET_BYTES);
+    struct dspinc_packet* recs = malloc(sizeof(struct dspinc_packet) * packets);
+
+    hist[0] = 0;
+    hist[1] = 0;
+
+    int64_t loopPacket = streamLoop.end >= 0 ? streamLoop.start / PACKET_SAMPLES : -1;
+    short loopHist[2] = {0};
+
+    /* Reconstruction for verification: the encoder's for re-encoded packets,
+     * reused packets decoded from the history they were encoded with */
+    short* reconAll = verify ? malloc(packets * PACKET_SAMPLES * sizeof(short)) : NULL;
+
+    int64_t reencoded = 0;
+    double newSignal = 0.0, newNoise = 0.0;
+    double oldSignal = 0.0, oldNoise = 0.0;
+    shift = 0;
+    for (int64_t p=0 ; p<packets ; ++p)
+    {
+        if (p == loopPacket)
+        {
+            loopHist[0] = hist[0];
+            loopHist[1] = hist[1];
+        }
+
+        int64_t q = match[p];
+        int numSamples = (int)MIN(samples - p * PACKET_SAMPLES, PACKET_SAMPLES);
+        if (q >= 0 && hist[0] == histBefore[q][0] && hist[1] == histBefore[q][1])
+        {
+            /* Converged; reuse the previous packet */
+            memcpy(blocks + p * PACKET_BYTES, prev.blocks + q * PACKET_BYTES, PACKET_BYTES);
+            recs[p] = prev.recs[q];
+            if (reconAll)
+                DSPDecodeFrame(blocks + p * PACKET_BYTES, numSamples, hist, coefs, reconAll + p * PACKET_SAMPLES);
+            hist[0] = histBefore[q+1][0];
+            hist[1] = histBefore[q+1][1];
+            shift = p - q;
+            continue;
+        }
+
+        /* Compare against the previous packet in the same place */
+        int64_t old = q >= 0 ? q : p - shift;
+        if (old >= 0 && old < prev.packets)
+        {
+            oldSignal += prev.recs[old].signal;
+            oldNoise += prev.recs[old].noise;
+        }
+
+        recon[0] = hist[0];
+        recon[1] = hist[1];
+        memset(recon + 2, 0, PACKET_SAMPLES * sizeof(short));
+        memcpy(recon + 2, pcm + p * PACKET_SAMPLES, numSamples * sizeof(short));
+        DSPEncodeFrameTuned(recon, PACKET_SAMPLES, blocks + p * PACKET_BYTES, coefs, tuning);
+        hist[0] = recon[14];
+        hist[1] = recon[15];
+        if (reconAll)
+            memcpy(reconAll + p * PACKET_SAMPLES, recon + 2, numSamples * sizeof(short));
+
+        MeasurePacket(pcm, samples, p, recon + 2, &recs[p]);
+        newSignal += recs[p].signal;
+        newNoise += recs[p].noise;
+        ++reencoded;
+    }
+    free(match);
+    free(prev.blocks);
+    free(prev.recs);
+
+    /* Edited content the previous coefs predict poorly needs a full encode */
+    double limit = GetSNR(prev.incHeader.signal, prev.incHeader.noise);
+    if (oldSignal > 0.0)
+        limit = fmin(limit, GetSNR(oldSignal, oldNoise));
+    limit -= FIT_TOLERANCE_DB;
+    double newSNR = GetSNR(newSignal, newNoise);
+
+    int ret = 0;
+    if (reencoded >= FIT_MIN_PACKETS && newSignal > 0.0 && newSNR < limit)
+    {
+        printf("INCREMENTAL: re-encoded SNR %.2f dB is below %.2f dB, coefs no longer fit; encoding in full\n",
+               newSNR, limit);
+        ret = -1;
+    }
+    else
+    {
+        FILE* fout = fopen(dspPath, "wb");
+        struct dsp_sidecar* sc = fout ? SidecarOpen(dspPath, tuning) : NULL;
+        if (!fout || !sc)
+        {
+            if (!fout)
+                fprintf(stderr, "'%s' won't open - %s\n", dspPath, strerror(errno));
+            else
+                fclose(fout);
+            ret = 1;
+        }
+        else
+        {
+            struct dspadpcm_header header;
+            DSPInitHeader(&header, samples, wav.sampleRate, prev.coefs);
+            DSPSetHeaderPs(&header, blocks);
+            if (loopPacket >= 0)
+                DSPSetHeaderLoop(&header, &streamLoop, blocks + loopPacket * PACKET_BYTES, loopHist, coefs);
+            fwrite(&header, 1, sizeof(header), fout);
+            fwrite(blocks, 1, GetBytesForAdpcmSamples(samples), fout);
+            fclose(fout);
+
+            fwrite(recs, sizeof(struct dspinc_packet), packets, sc->f);
+            for (int64_t p=0 ; p<packets ; ++p)
+            {
+                sc->header.signal += recs[p].signal;
+                sc->header.noise += recs[p].noise;
+            }
+            sc->header.sampleCount = samples;
+            SidecarClose(sc);
+
+            printf("INCREMENTAL: %" PRId64 " of %" PRId64 " packets re-encoded\n", reencoded, packets);
+            printf("DONE! %" PRId64 " samples processed\n", samples);
+
+            if (reconAll)
+            {
+                struct dsp_verifier* verifier = VerifyStart(coefs);
+                for (int64_t p=0 ; p<packets ; p+=VERIFY_CHUNK_PACKETS)
+                {
+                    int64_t first = p * PACKET_SAMPLES;
+                    VerifySubmit(verifier, pcm + first, reconAll + first, blocks + p * PACKET_BYTES,
+                                 MIN(samples - first, (int64_t)VERIFY_CHUNK_PACKETS * PACKET_SAMPLES));
+                }
+                ret = VerifyFinish(verifier);
+            }
+        }
+    }
+
+    free(reconAll);
+    free(histBefore);
+    free(blocks);
+    free(recs);
+    ClipScratchFree(&scratch);
+    return ret;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dspenc.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+/* Loop layout
+ * The hardware resumes a loop from the packet holding its start, so the
+ * start may be moved onto a packet boundary: padding shifts the whole stream
+ * with leading silence, unrolling repeats the head of the loop past its end
+ * and moves both points forward. Anything after the loop end is never played
+ * once unrolled, so it's dropped.
+ */
+void LoopLayoutInit(struct stream_layout* layout, int64_t first, int64_t samples)
+{
+    layout->first = first;
+    layout->pad = 0;
+    layout->wrapAt = samples;
+    layout->wrapTo = 0;
+    layout->samples = samples;
+    layout->loop.start = 0;
+    layout->loop.end = -1;
+}
+
+int LoopLayoutApply(struct stream_layout* layout, const struct dsp_loop* loop, int align, const char* name)
+{
+    if (loop->end < 0)
+        return 0;
+
+    if (loop->start < 0 || loop->start > loop->end || loop->end >= layout->samples)
+    {
+        fprintf(stderr, "'%s' loop %" PRId64 "-%" PRId64 " is outside its %" PRId64 " samples\n",
+                name, loop->start, loop->end, layout->samples);
+        return 1;
+    }
+
+    int64_t shift = (PACKET_SAMPLES - loop->start % PACKET_SAMPLES) % PACKET_SAMPLES;
+    if (align == LOOP_ALIGN_NONE || !shift)
+        shift = 0;
+    else if (align == LOOP_ALIGN_PAD)
+    {
+        layout->pad = shift;
+        layout->samples += shift;
+        layout->wrapAt = layout->samples;
+    }
+    else if (loop->end - loop->start + 1 < shift)
+    {
+        fprintf(stderr, "'%s' loop %" PRId64 "-%" PRId64 " is too short to unroll\n",
+                name, loop->start, loop->end);
+        return 1;
+    }
+    else
+    {
+        layout->wrapAt = loop->end + 1;
+        layout->wrapTo = layout->first + loop->start;
+        layout->samples = loop->end + 1 + shift;
+    }
+
+    layout->loop.start = loop->start + shift;
+    layout->loop.end = loop->end + shift;
+    return 0;
+}
+
+/* Read count stream samples starting at stream position pos */
+int64_t LoopReadSamples(FILE* fin, const struct wav_info* wav, const struct stream_layout* layout,
+                        int64_t pos, int16_t* buf, int64_t count)
+{
+    int64_t done = 0;
+    while (done < count)
+    {
+        int64_t at = pos + done;
+        int64_t n;
+        if (at < layout->pad)
+        {
+            n = MIN(count - done, layout->pad - at);
+            memset(buf + done, 0, n * sizeof(int16_t));
+        }
+        else if (at < layout->wrapAt)
+        {
+            n = MIN(count - done, layout->wrapAt - at);
+            WAVSeekSample(fin, wav, layout->first + at - layout->pad);
+            WAVReadSamples(fin, buf + done, n);
+        }
+        else
+        {
+            n = count - done;
+            WAVSeekSample(fin, wav, layout->wrapTo + at - layout->wrapAt);
+            WAVReadSamples(fin, buf + done, n);
+        }
+        done += n;
+    }
+
+    return count;
+}
+
+/* Rearrange a whole source (first == 0) in place; pcm must hold layout->samples */
+void LoopArrange(const struct stream_layout* layout, int16_t* pcm)
+{
+    if (layout->wrapAt < layout->samples)
+        memcpy(pcm + layout->wrapAt, pcm + layout->wrapTo, (layout->samples - layout->wrapAt) * sizeof(int16_t));
+
+    if (layout->pad)
+    {
+        memmove(pcm + layout->pad, pcm, (layout->samples - layout->pad) * sizeof(int16_t));
+        memset(pcm, 0, layout->pad * sizeof(int16_t));
+    }
+}
+
+/* <start>:<end> in samples, end inclusive */
+int LoopParse(const char* arg, struct dsp_loop* loop)
+{
+    char* sep;
+    loop->start = strtoll(arg, &sep, 0);
+    if (*sep != ':' || sep == arg)
+        return 1;
+
+    char* end;
+    loop->end = strtoll(sep + 1, &end, 0);
+    return *end || end == sep + 1 || loop->start < 0 || loop->end < loop->start;
+}
@@ -1,20 +1,40 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <math.h>
-
-void DSPCorrelateCoefs(short* source, int samples, short* coefs);
-void DSPEncodeFrame(short* source, int samples, unsigned char* dest, short* coefs);
+#include <getopt.h>
+#include <unistd.h>
+#include "dspenc.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
-#define VOTE_ALLOC_COUNT 1024
-#define CORRELATE_SAMPLES 0x3800 /* 1024 packets */
-#define PACKET_NIBBLES 16
-#define PACKET_SAMPLES 14
-#define PACKET_BYTES 8
+/* Samples are read and encoded in windows of this many packets */
+#define STREAM_WINDOW_PACKETS 0x100000
+
+/* Packets per encode span when tracing */
+#define TRACE_CHUNK_PACKETS 4096
+
+/* Long-only command line options */
+#define OPT_FAST_STATS 256
+#define OPT_MAX_SAMPLES 257
+#define OPT_TRACE 258
+#define OPT_BANK 259
+#define OPT_ALIGN 260
+#define OPT_DAEMON 261
+#define OPT_CLIENT 262
+#define OPT_INLINE 263
+#define OPT_BATCH 264
+#define OPT_SHUTDOWN 265
+#define OPT_SIDECAR 266
+#define OPT_INCREMENTAL 267
+#define OPT_VERIFY 268
+#define OPT_PRESET 269
+#define OPT_BENCH 270
+#define OPT_LOOP 271
+#define OPT_LOOP_ALIGN 272
 
 #if ALSA_PLAY
 #include <alsa/asoundlib.h>
@@ -25,172 +45,612 @@ snd_pcm_t* ALSA_PCM;
 FILE* WAVE_FILE_OUT = NULL;
 #endif
 
-/* Standard DSPADPCM header */
-struct dspadpcm_header
+/* Encoding options from the command line */
+struct encode_opts
 {
-    uint32_t num_samples;
-    uint32_t num_nibbles;
-    uint32_t sample_rate;
-    uint16_t loop_flag;
-    uint16_t format; /* 0 for ADPCM */
-    uint32_t loop_start;
-    uint32_t loop_end;
-    uint32_t ca;
-    int16_t coef[16];
-    int16_t gain;
-    int16_t ps;
-    int16_t hist1;
-    int16_t hist2;
-    int16_t loop_ps;
-    int16_t loop_hist1;
-    int16_t loop_hist2;
-    uint16_t pad[11];
+    int threadCount;
+    struct dsp_tuning tuning;
+    int fastStats;
+    int sidecar;
+    int verify;
+    int64_t maxSamples;
+    struct dsp_loop loop; /* Overrides the source's smpl loop if end >= 0 */
+    int loopAlign;
 };
 
-static int GetNibbleFromSample(int samples)
+/* Serially encode the whole buffer without output, returning SNR in dB */
+static double MeasureEncode(const int16_t* sampsBuf, int64_t samplecount, const short coefs[8][2],
+                            const struct dsp_tuning* tuning, double* secondsOut)
 {
-    int packets = samples / PACKET_SAMPLES;
-    int extraSamples = samples % PACKET_SAMPLES;
-    int extraNibbles = extraSamples == 0 ? 0 : extraSamples + 2;
-
-    return PACKET_NIBBLES * packets + extraNibbles;
-}
-
-static int GetNibbleAddress(int sample)
-{
-    int packets = sample / PACKET_SAMPLES;
-    int extraSamples = sample % PACKET_SAMPLES;
-
-    return PACKET_NIBBLES * packets + extraSamples + 2;
+    int64_t packets = samplecount / PACKET_SAMPLES + (samplecount % PACKET_SAMPLES != 0);
+    unsigned char* adpcm = malloc(packets * PACKET_BYTES);
+    short hist[2] = {0};
+    double start = GetSeconds();
+    DSPEncodeBuffer(sampsBuf, samplecount, coefs, hist, adpcm, tuning);
+    *secondsOut = GetSeconds() - start;
+
+    /* The decoder mirrors the encoder's reconstruction */
+    short pcmOut[PACKET_SAMPLES];
+    double signal = 0.0, noise = 0.0;
+    hist[0] = 0;
+    hist[1] = 0;
+    for (int64_t p=0 ; p<packets ; ++p)
+    {
+        int numSamples = (int)MIN(samplecount - p * PACKET_SAMPLES, PACKET_SAMPLES);
+        const int16_t* src = sampsBuf + p * PACKET_SAMPLES;
+        DSPDecodeFrame(adpcm + p * PACKET_BYTES, numSamples, hist, coefs, pcmOut);
+        for (int s=0 ; s<numSamples ; ++s)
+        {
+            double err = (double)src[s] - pcmOut[s];
+            signal += (double)src[s] * src[s];
+            noise += err * err;
+        }
+    }
+    free(adpcm);
+    return GetSNR(signal, noise);
 }
 
-static int GetBytesForAdpcmSamples(int samples)
+/* Report the SNR loss and speedup of each fast-mode candidate count */
+static void PrintFastStats(const int16_t* sampsBuf, int64_t samplecount, const short coefs[8][2],
+                           const struct dsp_tuning* tuning)
 {
-    int extraBytes = 0;
-    int packets = samples / PACKET_SAMPLES;
-    int extraSamples = samples % PACKET_SAMPLES;
+    struct dsp_tuning trial = *tuning;
+    trial.candidates = 8;
+    double exactSecs;
+    double exactSnr = MeasureEncode(sampsBuf, samplecount, coefs, &trial, &exactSecs);
 
-    if (extraSamples != 0)
+    printf(" k    SNR (dB)   loss (dB)   time (s)   speedup\n");
+    for (int k=1 ; k<=8 ; ++k)
     {
-        extraBytes = (extraSamples / 2) + (extraSamples % 2) + 1;
+        double secs;
+        trial.candidates = k;
+        double snr = k == 8 ? exactSnr : MeasureEncode(sampsBuf, samplecount, coefs, &trial, &secs);
+        if (k == 8)
+            secs = exactSecs;
+        printf(" %d  %10.3f  %10.3f  %9.3f  %7.2fx\n", k, snr, exactSnr - snr, secs, exactSecs / secs);
     }
+}
 
-    return PACKET_BYTES * packets + extraBytes;
+/* Split outputs are named <stem>_<part><ext> */
+static void MakePartPath(char* pathOut, size_t pathSz, const char* dspPath, int part)
+{
+    const char* ext = strrchr(dspPath, '.');
+    const char* slash = strrchr(dspPath, '/');
+    if (!ext || (slash && ext < slash))
+        ext = dspPath + strlen(dspPath);
+    snprintf(pathOut, pathSz, "%.*s_%d%s", (int)(ext - dspPath), dspPath, part, ext);
 }
 
-int main(int argc, char** argv)
+/* Correlate and encode the WAV data as laid out for one standalone
+ * DSPADPCM stream, streaming the source through a fixed-size window in both
+ * passes. A loop's context is the encoder history entering its packet, noted
+ * as the second pass reaches it */
+static int EncodeStream(FILE* fin, const struct wav_info* wav, const struct stream_layout* layout,
+                        const char* dspPath, const struct encode_opts* opts)
 {
-    int i,p,s;
+    int64_t p;
+    int s;
+    int64_t samplecount = layout->samples;
 
-    if (argc < 3)
+    int64_t packetCount = samplecount / PACKET_SAMPLES + (samplecount % PACKET_SAMPLES != 0);
+    int64_t windowSamples = MIN(samplecount, (int64_t)STREAM_WINDOW_PACKETS * PACKET_SAMPLES);
+    int16_t* sampsBuf = malloc(windowSamples * 2);
+
+    /* First pass correlates */
+    struct trace_span readSpan;
+    int16_t coefs[16];
+    struct dsp_correlator* correlator = DSPCorrelatorCreate(&opts->tuning);
+    for (int64_t i=0 ; i<samplecount ; i+=windowSamples)
     {
-        printf("Usage: %s <wavin> <dspout>\n", *argv);
-        return 1;
+        int64_t n = MIN(samplecount - i, windowSamples);
+        TraceBegin(&readSpan, "read");
+        LoopReadSamples(fin, wav, layout, i, sampsBuf, n);
+        TraceEnd(&readSpan, n * 2, n);
+        DSPCorrelateFeed(correlator, sampsBuf, n);
     }
+    DSPCorrelateFinish(correlator, coefs);
+    DSPCorrelatorFree(correlator);
 
-    FILE* fin = fopen(argv[1], "rb");
-    if (!fin)
+    /* Open output file */
+    FILE* fout = fopen(dspPath, "wb");
+    if (!fout)
     {
-        fprintf(stderr, "'%s' won't open - %s\n", argv[1], strerror(errno));
+        fprintf(stderr, "'%s' won't open - %s\n", dspPath, strerror(errno));
+        free(sampsBuf);
         return 1;
     }
-    char riffcheck[4];
-    fread(riffcheck, 1, 4, fin);
-    if (memcmp(riffcheck, "RIFF", 4))
+
+    struct dsp_sidecar* sidecar = NULL;
+    if (opts->sidecar && !(sidecar = SidecarOpen(dspPath, &opts->tuning)))
     {
-        fprintf(stderr, "'%s' not a valid RIFF file\n", argv[1]);
-        fclose(fin);
+        fclose(fout);
+        free(sampsBuf);
         return 1;
     }
-    fseek(fin, 4, SEEK_CUR);
-    fread(riffcheck, 1, 4, fin);
-    if (memcmp(riffcheck, "WAVE", 4))
+    struct dspadpcm_header header;
+    DSPInitHeader(&header, samplecount, wav->sampleRate, coefs);
+
+    int threadCount = opts->threadCount;
+#if ALSA_PLAY || defined(WRITE_WAV)
+    /* Debug outputs observe the reconstruction packet by packet */
+    threadCount = 1;
+#endif
+
+    unsigned char* adpcmBuf = malloc(windowSamples / PACKET_SAMPLES * PACKET_BYTES + PACKET_BYTES);
+
+    /* Verification decodes chunks of the window on its own thread */
+    short* reconBuf = NULL;
+    struct dsp_verifier* verifier = NULL;
+    if (opts->verify)
     {
-        fprintf(stderr, "'%s' not a valid WAVE file\n", argv[1]);
-        fclose(fin);
-        return 1;
+        reconBuf = malloc((windowSamples + PACKET_SAMPLES) * sizeof(short));
+        verifier = VerifyStart((const short(*)[2])coefs);
     }
 
-    uint32_t samplerate = 0;
-    uint32_t samplecount = 0;
-    while (fread(riffcheck, 1, 4, fin) == 4)
+    printf("\e[?25l"); /* hide the cursor */
+
+    /* Second pass executes encoding-predictor for each block */
+    struct trace_span span, chunkSpan;
+    int16_t convSamps[16] = {0};
+    int64_t repaired = 0;
+    int64_t loopPacket = layout->loop.end >= 0 ? layout->loop.start / PACKET_SAMPLES : -1;
+    short loopHist[2] = {0};
+    int headerStale = 0;
+    for (p=0 ; p<packetCount ;)
     {
-        uint32_t chunkSz;
-        fread(&chunkSz, 1, 4, fin);
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-        chunkSz = __builtin_bswap32(chunkSz);
-#endif
-        if (!memcmp(riffcheck, "fmt ", 4))
+        int64_t windowFirst = p * PACKET_SAMPLES;
+        int64_t n = MIN(samplecount - windowFirst, windowSamples);
+        int64_t windowPackets = n / PACKET_SAMPLES + (n % PACKET_SAMPLES != 0);
+        int64_t windowLoop = loopPacket - p;
+
+        TraceBegin(&span, "read");
+        LoopReadSamples(fin, wav, layout, windowFirst, sampsBuf, n);
+        TraceEnd(&span, n * 2, n);
+
+        if (p == 0 && opts->fastStats)
         {
-            uint16_t fmt;
-            fread(&fmt, 1, 2, fin);
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-            fmt = __builtin_bswap16(fmt);
-#endif
-            if (fmt != 1)
+            if (n < samplecount)
+                printf("FAST STATS over the first %" PRId64 " samples\n", n);
+            PrintFastStats(sampsBuf, n, (const short(*)[2])coefs, &opts->tuning);
+        }
+
+        if (threadCount > 1)
+        {
+            /* Segments split at the loop packet to expose the history entering it */
+            int64_t head = windowLoop >= 0 && windowLoop < windowPackets ? windowLoop * PACKET_SAMPLES : n;
+            if (head)
+                repaired += DSPEncodeParallel(sampsBuf, head, (const short(*)[2])coefs, convSamps,
+                                              adpcmBuf, reconBuf, threadCount, &opts->tuning);
+            if (head < n)
             {
-                fprintf(stderr, "'%s' has invalid format %u\n", argv[1], fmt);
-                fclose(fin);
-                return 1;
+                loopHist[0] = convSamps[0];
+                loopHist[1] = convSamps[1];
+                repaired += DSPEncodeParallel(sampsBuf + head, n - head, (const short(*)[2])coefs, convSamps,
+                                              adpcmBuf + head / PACKET_SAMPLES * PACKET_BYTES,
+                                              reconBuf ? reconBuf + head : NULL, threadCount, &opts->tuning);
             }
+            p += windowPackets;
+            if (verifier)
+                VerifySubmit(verifier, sampsBuf, reconBuf, adpcmBuf, n);
+        }
+        else
+        {
+            TraceBegin(&chunkSpan, "encode");
+            for (int64_t w=0 ; w<windowPackets ; ++w, ++p)
+            {
+                memset(convSamps + 2, 0, PACKET_SAMPLES * sizeof(int16_t));
+                int numSamples = (int)MIN(n - w * PACKET_SAMPLES, PACKET_SAMPLES);
 
-            uint16_t nchan;
-            fread(&nchan, 1, 2, fin);
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-            nchan = __builtin_bswap16(nchan);
+                for (s=0 ; s<numSamples; ++s)
+                    convSamps[s+2] = sampsBuf[w*PACKET_SAMPLES+s];
+
+                if (p == loopPacket)
+                {
+                    loopHist[0] = convSamps[0];
+                    loopHist[1] = convSamps[1];
+                }
+
+                DSPEncodeFrameTuned(convSamps, PACKET_SAMPLES, adpcmBuf + w * PACKET_BYTES,
+                                    (const short(*)[2])coefs, &opts->tuning);
+
+#if ALSA_PLAY
+                snd_pcm_writei(ALSA_PCM, convSamps+2, PACKET_SAMPLES);
 #endif
-            if (nchan != 1)
+#ifdef WRITE_WAV
+                fwrite(convSamps+2, 2, PACKET_SAMPLES, WAVE_FILE_OUT);
+#endif
+                if (reconBuf)
+                    memcpy(reconBuf + w * PACKET_SAMPLES, convSamps + 2, PACKET_SAMPLES * sizeof(short));
+
+                convSamps[0] = convSamps[14];
+                convSamps[1] = convSamps[15];
+
+                /* Trace the loop in sampled chunks */
+                if (!((w+1) % TRACE_CHUNK_PACKETS) || w+1 == windowPackets)
+                {
+                    int64_t chunkPackets = w % TRACE_CHUNK_PACKETS + 1;
+                    int64_t chunkFirst = (w + 1 - chunkPackets) * PACKET_SAMPLES;
+                    int64_t chunkSamples = MIN(chunkPackets * PACKET_SAMPLES, n - chunkFirst);
+                    TraceEnd(&chunkSpan, chunkPackets * PACKET_BYTES, chunkSamples);
+                    if (verifier)
+                        VerifySubmit(verifier, sampsBuf + chunkFirst, reconBuf + chunkFirst,
+                                     adpcmBuf + (w + 1 - chunkPackets) * PACKET_BYTES, chunkSamples);
+                    TraceBegin(&chunkSpan, "encode");
+                }
+
+                if (!(p%48))
+                    printf("\rPREDICT [ %" PRId64 " / %" PRId64 " ]          ", p+1, packetCount);
+            }
+        }
+
+        TraceBegin(&span, "write");
+        if (windowLoop >= 0 && windowLoop < windowPackets)
+        {
+            DSPSetHeaderLoop(&header, &layout->loop, adpcmBuf + windowLoop * PACKET_BYTES, loopHist,
+                             (const short(*)[2])coefs);
+            headerStale = windowFirst != 0;
+        }
+        if (windowFirst == 0)
+        {
+            DSPSetHeaderPs(&header, adpcmBuf);
+            fwrite(&header, 1, sizeof(header), fout);
+        }
+
+        int64_t bytes = GetBytesForAdpcmSamples(n);
+        fwrite(adpcmBuf, 1, bytes, fout);
+        if (sidecar)
+            SidecarAppend(sidecar, sampsBuf, n, adpcmBuf, (const short(*)[2])coefs);
+        TraceEnd(&span, bytes, n);
+    }
+    printf("\rPREDICT [ %" PRId64 " / %" PRId64 " ]          ", p, packetCount);
+    if (threadCount > 1)
+        printf("\nREPAIR: %" PRId64 " packets re-encoded at segment boundaries", repaired);
+    printf("\nDONE! %" PRId64 " samples processed\n", samplecount);
+    printf("\e[?25h"); /* show the cursor */
+
+    /* Loop packet came after the first window */
+    if (headerStale)
+    {
+        fseek(fout, 0, SEEK_SET);
+        fwrite(&header, 1, sizeof(header), fout);
+    }
+    fclose(fout);
+    if (sidecar)
+        SidecarClose(sidecar);
+
+    int ret = 0;
+    if (verifier)
+        ret = VerifyFinish(verifier);
+    free(reconBuf);
+    free(adpcmBuf);
+    free(sampsBuf);
+
+    return ret;
+}
+
+/* Gather bank clip paths; '@list' arguments name files with one path per line
+ * Returns NULL with a count of -1 if a list won't open */
+static char** GatherClipPaths(char** args, int argCount, int* clipCountOut)
+{
+    char** paths = NULL;
+    int count = 0, cap = 0;
+
+    for (int a=0 ; a<argCount ; ++a)
+    {
+        FILE* list = NULL;
+        char line[4096];
+        const char* path = args[a];
+
+        if (args[a][0] == '@')
+        {
+            list = fopen(args[a] + 1, "r");
+            if (!list)
             {
-                fprintf(stderr, "'%s' must have 1 channel, not %u\n", argv[1], nchan);
-                fclose(fin);
-                return 1;
+                fprintf(stderr, "'%s' won't open - %s\n", args[a] + 1, strerror(errno));
+                for (int i=0 ; i<count ; ++i)
+                    free(paths[i]);
+                free(paths);
+                *clipCountOut = -1;
+                return NULL;
             }
+        }
 
-            fread(&samplerate, 1, 4, fin);
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-            samplerate = __builtin_bswap32(samplerate);
-#endif
-            fseek(fin, 4, SEEK_CUR);
+        while (!list || fgets(line, sizeof(line), list))
+        {
+            if (list)
+            {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (!line[0])
+                    continue;
+                path = line;
+            }
 
-            uint16_t bytesPerSample;
-            fread(&bytesPerSample, 1, 2, fin);
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-            bytesPerSample = __builtin_bswap16(bytesPerSample);
-#endif
-            if (bytesPerSample != 2)
+            if (count == cap)
             {
-                fprintf(stderr, "'%s' must have 2 bytes per sample, not %u\n", argv[1], bytesPerSample);
-                fclose(fin);
-                return 1;
+                cap = cap ? cap * 2 : 64;
+                paths = realloc(paths, sizeof(char*) * cap);
             }
+            paths[count++] = strdup(path);
 
-            uint16_t bitsPerSample;
-            fread(&bitsPerSample, 1, 2, fin);
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-            bitsPerSample = __builtin_bswap16(bitsPerSample);
-#endif
-            if (bitsPerSample != 16)
+            if (!list)
+                break;
+        }
+
+        if (list)
+            fclose(list);
+    }
+
+    *clipCountOut = count;
+    return paths;
+}
+
+static void PrintUsage(const char* prog)
+{
+    printf("Usage: %s [options] <wavin> <dspout>\n"
+           "       %s [options] --bank <bankout> <clip.wav|@cliplist>...\n"
+           "       %s [options] --daemon <socket>\n"
+           "       %s [options] --client <socket> <wavin> <dspout>\n"
+           "       %s --bench [wavin...]\n"
+           "      --preset <name>    encoder speed/quality preset: fast, default or max\n"
+           "  -j, --threads <n>      encode segments in parallel on n threads (0 = all cores)\n"
+           "  -k, --fast <k>         approximate mode: fully search only the k coef sets (1-8)\n"
+           "                         with the smallest prediction residual (overrides the preset)\n"
+           "      --fast-stats       report SNR loss and speedup of each k before encoding\n"
+           "      --max-samples <n>  split into streams of at most n samples\n"
+           "                         (default and upper bound %" PRId64 ")\n"
+           "      --trace <json>     write a Chrome/Perfetto trace-event timeline of the encode\n"
+           "      --bank <bankout>   encode many clips into one packed sound bank\n"
+           "      --align <n>        bank payload alignment in bytes (default 32)\n"
+           "      --daemon <socket>  serve encode jobs on a Unix socket with a pool of -j workers\n"
+           "      --client <socket>  submit the encode to a daemon instead of running it here\n"
+           "      --inline           (client) send PCM and receive .dsp bytes over the socket\n"
+           "                         rather than having the daemon access the files\n"
+           "      --batch            (client) queue behind interactive jobs\n"
+           "      --shutdown         (client) stop the daemon once queued jobs finish\n"
+           "      --sidecar          also write <dspout>.inc with per-packet source hashes\n"
+           "      --incremental      re-encode only the packets that changed since the previous\n"
+           "                         <dspout> and its sidecar, falling back to a full encode\n"
+           "      --verify           decode each packet alongside the encode, check it against the\n"
+           "                         encoder's reconstruction and report SNR, worst frames and clipping\n"
+           "      --bench            sweep the preset knobs over the given WAVs (or synthetic\n"
+           "                         signals) and report the throughput/SNR Pareto frontier\n"
+           "      --loop <s>:<e>     loop from sample s to e inclusive (default: the smpl chunk's\n"
+           "                         first loop); a looped source is never split\n"
+           "      --loop-align <m>   move a loop start onto a packet boundary: pad leads with\n"
+           "                         silence, unroll repeats the loop head past its end\n",
+           prog, prog, prog, prog, prog, MAX_STREAM_SAMPLES);
+}
+
+int main(int argc, char** argv)
+{
+    struct encode_opts opts = {};
+    opts.threadCount = 1;
+    opts.tuning = *DSPDefaultTuning();
+    opts.maxSamples = MAX_STREAM_SAMPLES;
+    opts.loop.end = -1;
+
+    static const struct option longOpts[] =
+    {
+        {"threads", required_argument, NULL, 'j'},
+        {"fast", required_argument, NULL, 'k'},
+        {"fast-stats", no_argument, NULL, OPT_FAST_STATS},
+        {"max-samples", required_argument, NULL, OPT_MAX_SAMPLES},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {"bank", required_argument, NULL, OPT_BANK},
+        {"align", required_argument, NULL, OPT_ALIGN},
+        {"daemon", required_argument, NULL, OPT_DAEMON},
+        {"client", required_argument, NULL, OPT_CLIENT},
+        {"inline", no_argument, NULL, OPT_INLINE},
+        {"batch", no_argument, NULL, OPT_BATCH},
+        {"shutdown", no_argument, NULL, OPT_SHUTDOWN},
+        {"sidecar", no_argument, NULL, OPT_SIDECAR},
+        {"incremental", no_argument, NULL, OPT_INCREMENTAL},
+        {"verify", no_argument, NULL, OPT_VERIFY},
+        {"preset", required_argument, NULL, OPT_PRESET},
+        {"bench", no_argument, NULL, OPT_BENCH},
+        {"loop", required_argument, NULL, OPT_LOOP},
+        {"loop-align", required_argument, NULL, OPT_LOOP_ALIGN},
+        {NULL, 0, NULL, 0}
+    };
+
+    const char* tracePath = NULL;
+    const char* bankPath = NULL;
+    uint32_t bankAlign = 32;
+    const char* daemonPath = NULL;
+    const char* clientPath = NULL;
+    uint32_t clientFlags = 0;
+    int incremental = 0;
+    int candidates = 0;
+    int bench = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:k:", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_FAST_STATS:
+            opts.fastStats = 1;
+            break;
+        case OPT_MAX_SAMPLES:
+            opts.maxSamples = strtoll(optarg, NULL, 0);
+            if (opts.maxSamples < PACKET_SAMPLES || opts.maxSamples > MAX_STREAM_SAMPLES)
             {
-                fprintf(stderr, "'%s' must have 16 bits per sample, not %u\n", argv[1], bitsPerSample);
-                fclose(fin);
+                fprintf(stderr, "max samples must be %d-%" PRId64 ", not '%s'\n",
+                        PACKET_SAMPLES, MAX_STREAM_SAMPLES, optarg);
                 return 1;
             }
-        }
-        else if (!memcmp(riffcheck, "data", 4))
+            /* Whole packets so that each part ends on a packet boundary */
+            opts.maxSamples -= opts.maxSamples % PACKET_SAMPLES;
+            break;
+        case OPT_TRACE:
+            tracePath = optarg;
+            break;
+        case OPT_BANK:
+            bankPath = optarg;
+            break;
+        case OPT_ALIGN:
+            bankAlign = (uint32_t)strtoul(optarg, NULL, 0);
+            if (!bankAlign || (bankAlign & (bankAlign - 1)))
+            {
+                fprintf(stderr, "bank alignment must be a power of two, not '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_DAEMON:
+            daemonPath = optarg;
+            break;
+        case OPT_CLIENT:
+            clientPath = optarg;
+            break;
+        case OPT_INLINE:
+            clientFlags |= DAEMON_INLINE;
+            break;
+        case OPT_BATCH:
+            clientFlags |= DAEMON_BATCH;
+            break;
+        case OPT_SHUTDOWN:
+            clientFlags |= DAEMON_SHUTDOWN;
+            break;
+        case OPT_SIDECAR:
+            opts.sidecar = 1;
+            break;
+        case OPT_INCREMENTAL:
+            incremental = 1;
+            opts.sidecar = 1;
+            break;
+        case OPT_VERIFY:
+            opts.verify = 1;
+            break;
+        case OPT_PRESET:
         {
-            samplecount = chunkSz / 2;
+            const struct dsp_tuning* preset = DSPFindPreset(optarg);
+            if (!preset)
+            {
+                fprintf(stderr, "unknown preset '%s'\n", optarg);
+                return 1;
+            }
+            opts.tuning = *preset;
             break;
         }
-        else
-            fseek(fin, chunkSz, SEEK_CUR);
+        case OPT_BENCH:
+            bench = 1;
+            break;
+        case OPT_LOOP:
+            if (LoopParse(optarg, &opts.loop))
+            {
+                fprintf(stderr, "loop must be <start>:<end> with start <= end, not '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_LOOP_ALIGN:
+            if (!strcmp(optarg, "pad"))
+                opts.loopAlign = LOOP_ALIGN_PAD;
+            else if (!strcmp(optarg, "unroll"))
+                opts.loopAlign = LOOP_ALIGN_UNROLL;
+            else
+            {
+                fprintf(stderr, "loop alignment must be pad or unroll, not '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            opts.threadCount = atoi(optarg);
+            if (opts.threadCount <= 0)
+                opts.threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (opts.threadCount <= 0)
+                opts.threadCount = 1;
+            break;
+        case 'k':
+            candidates = atoi(optarg);
+            if (candidates < 1 || candidates > 8)
+            {
+                fprintf(stderr, "fast mode candidate count must be 1-8, not '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            PrintUsage(*argv);
+            return 1;
+        }
     }
+    if (candidates)
+        opts.tuning.candidates = candidates;
+
+    if (bench)
+        return BenchRun(argv + optind, argc - optind);
 
-    if (!samplerate || !samplecount)
+    if (daemonPath)
     {
-        fprintf(stderr, "'%s' must have a valid data chunk following a fmt chunk\n", argv[1]);
-        fclose(fin);
+        if (tracePath && TraceOpen(tracePath))
+            return 1;
+        int ret = DaemonServe(daemonPath, opts.threadCount);
+        TraceClose();
+        return ret;
+    }
+
+    /* The daemon encodes without a verifier or sidecar */
+    if (clientPath && (opts.verify || opts.sidecar))
+    {
+        fprintf(stderr, "--verify, --sidecar and --incremental can't be used with --client\n");
+        return 1;
+    }
+
+    if (clientPath && (clientFlags & DAEMON_SHUTDOWN))
+        return DaemonSubmit(clientPath, NULL, NULL, clientFlags, &opts.tuning, &opts.loop, opts.loopAlign);
+
+    if (bankPath)
+    {
+        int clipCount;
+        char** clipPaths = GatherClipPaths(argv + optind, argc - optind, &clipCount);
+        if (clipCount < 0)
+            return 1;
+        if (!clipCount)
+        {
+            PrintUsage(*argv);
+            return 1;
+        }
+
+        if (tracePath && TraceOpen(tracePath))
+            return 1;
+        int ret = BankEncode(bankPath, clipPaths, clipCount, opts.threadCount, &opts.tuning, bankAlign, opts.loopAlign);
+        TraceClose();
+
+        for (int i=0 ; i<clipCount ; ++i)
+            free(clipPaths[i]);
+        free(clipPaths);
+        return ret;
+    }
+
+    if (argc - optind < 2)
+    {
+        PrintUsage(*argv);
         return 1;
     }
+    const char* wavPath = argv[optind];
+    const char* dspPath = argv[optind + 1];
+
+    if (clientPath)
+        return DaemonSubmit(clientPath, wavPath, dspPath, clientFlags, &opts.tuning, &opts.loop, opts.loopAlign);
+
+    if (incremental)
+    {
+        int ret = IncrementalEncode(wavPath, dspPath, &opts.tuning, &opts.loop, opts.loopAlign, opts.verify);
+        if (ret >= 0)
+            return ret;
+    }
+
+    if (tracePath && TraceOpen(tracePath))
+        return 1;
+
+    struct trace_span span;
+    TraceBegin(&span, "parse wav");
+    struct wav_info wav;
+    FILE* fin = WAVOpen(wavPath, &wav);
+    if (!fin)
+    {
+        TraceClose();
+        return 1;
+    }
+    TraceEnd(&span, wav.dataOffset, wav.sampleCount);
 
 #if ALSA_PLAY
     snd_pcm_open(&ALSA_PCM, "default", SND_PCM_STREAM_PLAYBACK, 0);
@@ -203,7 +663,7 @@ int main(int argc, char** argv)
 #else
     snd_pcm_hw_params_set_format(ALSA_PCM, hwparams, SND_PCM_FORMAT_S16_LE);
 #endif
-    unsigned int sample_rate = samplerate;
+    unsigned int sample_rate = wav.sampleRate;
     snd_pcm_hw_params_set_rate_near(ALSA_PCM, hwparams, &sample_rate, 0);
     snd_pcm_hw_params_set_channels(ALSA_PCM, hwparams, 1);
     snd_pcm_hw_params(ALSA_PCM, hwparams);
@@ -211,7 +671,7 @@ int main(int argc, char** argv)
 
 #ifdef WRITE_WAV
     char wavePathOut[1024];
-    snprintf(wavePathOut, 1024, "%s.wav", argv[2]);
+    snprintf(wavePathOut, 1024, "%s.wav", dspPath);
     WAVE_FILE_OUT = fopen(wavePathOut, "wb");
     if (!WAVE_FILE_OUT)
     {
@@ -219,96 +679,51 @@ int main(int argc, char** argv)
         fclose(fin);
         return 1;
     }
-    for (i=0 ; i<11 ; ++i)
+    for (int i=0 ; i<11 ; ++i)
         fwrite("\0\0\0\0", 1, 4, WAVE_FILE_OUT);
 #endif
 
-    int packetCount = samplecount / PACKET_SAMPLES + (samplecount % PACKET_SAMPLES != 0);
-    size_t sampsBufSz = samplecount * 2;
-    int16_t* sampsBuf = malloc(sampsBufSz);
-    memset(sampsBuf, 0, sampsBufSz);
-    fread(sampsBuf, samplecount, 2, fin);
-    fclose(fin);
-
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-    for(i = 0; i < samplecount; i++)
-        sampsBuf[i] = __builtin_bswap16(sampsBuf[i]);
-#endif
-
-    int16_t coefs[16];
-    DSPCorrelateCoefs(sampsBuf, samplecount, coefs);
-
-    /* Open output file */
-    FILE* fout = fopen(argv[2], "wb");
-    if (!fout)
+    /* Sources too long for the header fields become several streams,
+     * except looped ones since the loop can't span parts */
+    struct dsp_loop loop = opts.loop.end >= 0 ? opts.loop : wav.loop;
+    struct stream_layout layout;
+    int partCount = (int)((wav.sampleCount + opts.maxSamples - 1) / opts.maxSamples);
+    int ret = 0;
+    if (loop.end >= 0)
     {
-        fprintf(stderr, "'%s' won't open - %s\n", argv[2], strerror(errno));
-        return 1;
+        partCount = 1;
+        LoopLayoutInit(&layout, 0, wav.sampleCount);
+        ret = LoopLayoutApply(&layout, &loop, opts.loopAlign, wavPath);
+        if (!ret && layout.samples > opts.maxSamples)
+        {
+            fprintf(stderr, "'%s' loops, so it can't be split into streams of %" PRId64 " samples\n",
+                    wavPath, opts.maxSamples);
+            ret = 1;
+        }
+        if (!ret && layout.loop.start != loop.start)
+            printf("LOOP: %" PRId64 "-%" PRId64 " moved to %" PRId64 "-%" PRId64 "\n",
+                   loop.start, loop.end, layout.loop.start, layout.loop.end);
     }
-    struct dspadpcm_header header = {};
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-    header.num_samples = samplecount;
-    header.num_nibbles = GetNibbleFromSample(samplecount);
-    header.sample_rate = samplerate;
-    header.loop_start = GetNibbleAddress(0);
-    header.loop_end = GetNibbleAddress(samplecount - 1);
-    header.ca = GetNibbleAddress(0);
-    for (i=0 ; i<16 ; ++i)
-        header.coef[i] = coefs[i];
-#else
-    header.num_samples = __builtin_bswap32(samplecount);
-    header.num_nibbles = __builtin_bswap32(GetNibbleFromSample(samplecount));
-    header.sample_rate = __builtin_bswap32(samplerate);
-    header.loop_start = __builtin_bswap32(GetNibbleAddress(0));
-    header.loop_end = __builtin_bswap32(GetNibbleAddress(samplecount - 1));
-    header.ca = __builtin_bswap32(GetNibbleAddress(0));
-    for (i=0 ; i<16 ; ++i)
-        header.coef[i] = __builtin_bswap16(coefs[i]);
-#endif
-
-    printf("\e[?25l"); /* hide the cursor */
-
-    /* Execute encoding-predictor for each block */
-    int16_t convSamps[16] = {0};
-    unsigned char block[8];
-    for (p=0 ; p<packetCount ; ++p)
+    for (int part=0 ; part<partCount && !ret ; ++part)
     {
-        memset(convSamps + 2, 0, PACKET_SAMPLES * sizeof(int16_t));
-        int numSamples = MIN(samplecount - p * PACKET_SAMPLES, PACKET_SAMPLES);
-
-        for (s=0 ; s<numSamples; ++s)
-            convSamps[s+2] = sampsBuf[p*PACKET_SAMPLES+s];
-
-        DSPEncodeFrame(convSamps, PACKET_SAMPLES, block, coefs);
-
-#if ALSA_PLAY
-        snd_pcm_writei(ALSA_PCM, convSamps+2, PACKET_SAMPLES);
-#endif
-#ifdef WRITE_WAV
-        fwrite(convSamps+2, 2, PACKET_SAMPLES, WAVE_FILE_OUT);
-#endif
+        if (loop.end < 0)
+        {
+            int64_t first = part * opts.maxSamples;
+            LoopLayoutInit(&layout, first, MIN(wav.sampleCount - first, opts.maxSamples));
+        }
 
-        convSamps[0] = convSamps[14];
-        convSamps[1] = convSamps[15];
-        
-        if (p == 0)
+        char partPath[1024];
+        if (partCount > 1)
         {
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-            header.ps = block[0];
-#else
-            header.ps = __builtin_bswap16(block[0]);
-#endif
-            fwrite(&header, 1, sizeof(header), fout);
+            MakePartPath(partPath, 1024, dspPath, part);
+            printf("PART %d / %d: '%s'\n", part + 1, partCount, partPath);
         }
+        else
+            snprintf(partPath, 1024, "%s", dspPath);
 
-        fwrite(block, 1, GetBytesForAdpcmSamples(numSamples), fout);
-        
-        if (!(p%48))
-            printf("\rPREDICT [ %d / %d ]          ", p+1, packetCount);
+        ret = EncodeStream(fin, &wav, &layout, partPath, &opts);
     }
-    printf("\rPREDICT [ %d / %d ]          ", p, packetCount);
-    printf("\nDONE! %d samples processed\n", samplecount);
-    printf("\e[?25h"); /* show the cursor */
+    fclose(fin);
 
     //printf("ERROR: %ld\n", ERROR_AVG / ERROR_SAMP_COUNT);
 
@@ -321,8 +736,8 @@ int main(int argc, char** argv)
     fwrite("fmt ", 1, 4, WAVE_FILE_OUT);
     uint32_t sixteen = 16;
     uint16_t one = 1;
-    uint32_t threetwok = samplerate;
-    uint32_t sixfourk = samplerate * 2;
+    uint32_t threetwok = wav.sampleRate;
+    uint32_t sixfourk = wav.sampleRate * 2;
     uint16_t two = 2;
     uint16_t sixteens = 16;
     fwrite(&sixteen, 1, 4, WAVE_FILE_OUT);
@@ -338,14 +753,11 @@ int main(int argc, char** argv)
     fclose(WAVE_FILE_OUT);
 #endif
 
-    fclose(fout);
-    free(sampsBuf);
-
 #if ALSA_PLAY
     snd_pcm_drain(ALSA_PCM);
     snd_pcm_close(ALSA_PCM);
 #endif
 
-    return 0;
+    TraceClose();
+    return ret;
 }
-
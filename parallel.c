@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "dspenc.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+/* Segments shorter than this aren't worth a thread */
+#define MIN_SEGMENT_PACKETS 256
+
+/* Speculative segment-parallel encoder
+ * Each segment is encoded on its own thread, starting from a history
+ * guessed from the source PCM rather than the (not yet known) reconstructed
+ * history of the preceding segment. Reconstructed history resynchronizes
+ * within a few packets, so boundaries are afterwards re-encoded serially
+ * until the history matches what the speculative pass produced, yielding
+ * output identical to a serial encode.
+ */
+struct segment
+{
+    const short* source;
+    int64_t samples;
+    const short (*coefs)[2];
+    unsigned char* adpcmOut;
+    short* reconOut;
+    short (*histOut)[2];
+    int64_t startPacket;
+    int64_t endPacket;
+    short guess[2];
+    const struct dsp_tuning* tuning;
+    pthread_t thread;
+    int threaded;
+};
+
+static void EncodePacket(const short* source, int64_t samples, int64_t p, short hist[2],
+                         const short coefs[8][2], const struct dsp_tuning* tuning, unsigned char block[8],
+                         short* reconOut)
+{
+    short convSamps[16] = {0};
+    int numSamples = (int)MIN(samples - p * PACKET_SAMPLES, PACKET_SAMPLES);
+
+    convSamps[0] = hist[0];
+    convSamps[1] = hist[1];
+    memcpy(convSamps + 2, source + p * PACKET_SAMPLES, numSamples * sizeof(short));
+
+    DSPEncodeFrameTuned(convSamps, PACKET_SAMPLES, block, coefs, tuning);
+    if (reconOut)
+        memcpy(reconOut + p * PACKET_SAMPLES, convSamps + 2, numSamples * sizeof(short));
+
+    hist[0] = convSamps[14];
+    hist[1] = convSamps[15];
+}
+
+static void* EncodeSegment(void* arg)
+{
+    struct segment* seg = arg;
+    short hist[2] = {seg->guess[0], seg->guess[1]};
+
+    struct trace_span span;
+    if (seg->threaded)
+        TraceSetThreadName("encode segment");
+    TraceBegin(&span, "encode segment");
+
+    for (int64_t p=seg->startPacket ; p<seg->endPacket ; ++p)
+    {
+        EncodePacket(seg->source, seg->samples, p, hist, seg->coefs, seg->tuning,
+                     seg->adpcmOut + p * PACKET_BYTES, seg->reconOut);
+        seg->histOut[p][0] = hist[0];
+        seg->histOut[p][1] = hist[1];
+    }
+
+    int64_t samples = MIN(seg->samples - seg->startPacket * PACKET_SAMPLES,
+                          (seg->endPacket - seg->startPacket) * PACKET_SAMPLES);
+    TraceEnd(&span, (seg->endPacket - seg->startPacket) * PACKET_BYTES, samples);
+    return NULL;
+}
+
+int64_t DSPEncodeParallel(const short* source, int64_t samples, const short coefsIn[8][2], short hist[2],
+                          unsigned char* adpcmOut, short* reconOut, int threadCount,
+                          const struct dsp_tuning* tuning)
+{
+    int64_t packetCount = samples / PACKET_SAMPLES + (samples % PACKET_SAMPLES != 0);
+    int segCount = (int)MIN(threadCount, packetCount / MIN_SEGMENT_PACKETS);
+    if (segCount < 1)
+        segCount = 1;
+
+    struct segment* segs = calloc(sizeof(struct segment), segCount);
+    short (*histOut)[2] = calloc(sizeof(short[2]), packetCount);
+
+    for (int k=0 ; k<segCount ; ++k)
+    {
+        struct segment* seg = &segs[k];
+        seg->source = source;
+        seg->samples = samples;
+        seg->coefs = coefsIn;
+        seg->adpcmOut = adpcmOut;
+        seg->reconOut = reconOut;
+        seg->histOut = histOut;
+        seg->tuning = tuning;
+        seg->startPacket = packetCount * k / segCount;
+        seg->endPacket = packetCount * (k + 1) / segCount;
+
+        /* First segment continues from the caller's history;
+         * best guess for the others is the source PCM itself */
+        if (!seg->startPacket)
+        {
+            seg->guess[0] = hist[0];
+            seg->guess[1] = hist[1];
+        }
+        else
+        {
+            seg->guess[0] = source[seg->startPacket * PACKET_SAMPLES - 2];
+            seg->guess[1] = source[seg->startPacket * PACKET_SAMPLES - 1];
+        }
+    }
+
+    /* First segment runs on the calling thread */
+    for (int k=1 ; k<segCount ; ++k)
+    {
+        segs[k].threaded = 1;
+        if (pthread_create(&segs[k].thread, NULL, EncodeSegment, &segs[k]))
+            segs[k].threaded = 0;
+    }
+    for (int k=0 ; k<segCount ; ++k)
+        if (!segs[k].threaded)
+            EncodeSegment(&segs[k]);
+    for (int k=1 ; k<segCount ; ++k)
+        if (segs[k].threaded)
+            pthread_join(segs[k].thread, NULL);
+
+    /* Serially repair boundaries until reconstructed history converges
+     * with the history each speculative packet was encoded from */
+    struct trace_span span;
+    TraceBegin(&span, "repair boundaries");
+    int64_t repaired = 0;
+    int64_t p = 0;
+    for (int k=1 ; k<segCount ; ++k)
+    {
+        if (p > segs[k].startPacket)
+            continue;
+
+        p = segs[k].startPacket;
+        short specIn[2] = {segs[k].guess[0], segs[k].guess[1]};
+        int nextSeg = k + 1;
+
+        while (p < packetCount)
+        {
+            short cur[2] = {histOut[p-1][0], histOut[p-1][1]};
+            if (cur[0] == specIn[0] && cur[1] == specIn[1])
+                break;
+
+            /* Packet p+1 was speculatively encoded from p's old history */
+            specIn[0] = histOut[p][0];
+            specIn[1] = histOut[p][1];
+
+            EncodePacket(source, samples, p, cur, coefsIn, tuning, adpcmOut + p * PACKET_BYTES, reconOut);
+            histOut[p][0] = cur[0];
+            histOut[p][1] = cur[1];
+            ++repaired;
+            ++p;
+
+            if (nextSeg < segCount && p == segs[nextSeg].startPacket)
+            {
+                specIn[0] = segs[nextSeg].guess[0];
+                specIn[1] = segs[nextSeg].guess[1];
+                ++nextSeg;
+            }
+        }
+    }
+
+    TraceEnd(&span, repaired * PACKET_BYTES, repaired * PACKET_SAMPLES);
+
+    /* Hand back the history for a following call */
+    if (packetCount)
+    {
+        hist[0] = histOut[packetCount-1][0];
+        hist[1] = histOut[packetCount-1][1];
+    }
+
+    free(histOut);
+    free(segs);
+
+    return repaired;
+}
@@ -0,0 +1,45 @@
+#include <string.h>
+#include "dspenc.h"
+
+/* Named speed/quality presets
+ * `default` reproduces the original encoder bit for bit. `fast` runs fewer
+ * k-means passes and fully searches fewer coef sets, `max` runs more passes
+ * and the full scale search; --bench reports where each lands against the
+ * rest of its sweep. Skipping the scale retry loop costs far more SNR than
+ * any other knob saves, so every preset keeps it.
+ */
+static const struct dsp_tuning FAST_TUNING    = {1024, 10.0, 1, 3, SCALE_SEARCH_RETRY, 2};
+static const struct dsp_tuning DEFAULT_TUNING = {1024, 10.0, 2, 3, SCALE_SEARCH_RETRY, 8};
+static const struct dsp_tuning MAX_TUNING     = {1024, 10.0, 8, 3, SCALE_SEARCH_FULL, 8};
+
+const struct dsp_preset DSP_PRESETS[] =
+{
+    {"fast",    &FAST_TUNING},
+    {"default", &DEFAULT_TUNING},
+    {"max",     &MAX_TUNING},
+    {NULL, NULL}
+};
+
+const struct dsp_tuning* DSPDefaultTuning()
+{
+    return &DEFAULT_TUNING;
+}
+
+const struct dsp_tuning* DSPFindPreset(const char* name)
+{
+    for (const struct dsp_preset* preset=DSP_PRESETS ; preset->name ; ++preset)
+        if (!strcmp(preset->name, name))
+            return preset->tuning;
+    return NULL;
+}
+
+/* Sanity check tuning that arrived from outside, e.g. over the daemon socket */
+int DSPTuningValid(const struct dsp_tuning* tuning)
+{
+    return tuning->chunkPackets >= 1 && tuning->chunkPackets <= 0x10000 &&
+           tuning->recordThreshold >= 0.0 &&
+           tuning->kmeansPasses >= 1 && tuning->kmeansPasses <= 64 &&
+           tuning->splitLevels >= 1 && tuning->splitLevels <= 3 &&
+           tuning->scaleSearch >= SCALE_SEARCH_RETRY && tuning->scaleSearch <= SCALE_SEARCH_FULL &&
+           tuning->candidates >= 1 && tuning->candidates <= 8;
+}
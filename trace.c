@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "dspenc.h"
+
+/* Chrome/Perfetto trace-event JSON writer
+ * Spans are emitted as complete ("X") events as soon as they end, in the
+ * JSON array format whose closing bracket is optional, so a trace stays
+ * usable up to the point a run was interrupted.
+ */
+static FILE* TRACE_FILE = NULL;
+static pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static double TRACE_EPOCH;
+static int TRACE_PID;
+static int TRACE_NEXT_TID = 1;
+static int TRACE_EVENT_COUNT;
+static __thread int TRACE_TID;
+
+static double GetMicroseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1.0e6 + ts.tv_nsec / 1.0e3;
+}
+
+/* Monotonic wall clock for timing measurements outside the trace */
+double GetSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+/* Caller holds TRACE_LOCK */
+static int GetTid()
+{
+    if (!TRACE_TID)
+        TRACE_TID = TRACE_NEXT_TID++;
+    return TRACE_TID;
+}
+
+/* Caller holds TRACE_LOCK */
+static void BeginEvent()
+{
+    fputs(TRACE_EVENT_COUNT++ ? ",\n" : "\n", TRACE_FILE);
+}
+
+int TraceOpen(const char* path)
+{
+    TRACE_FILE = fopen(path, "w");
+    if (!TRACE_FILE)
+    {
+        fprintf(stderr, "'%s' won't open - %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    TRACE_EPOCH = GetMicroseconds();
+    TRACE_PID = getpid();
+    fputc('[', TRACE_FILE);
+    TraceSetThreadName("main");
+    return 0;
+}
+
+void TraceClose()
+{
+    if (!TRACE_FILE)
+        return;
+
+    fputs("\n]\n", TRACE_FILE);
+    fclose(TRACE_FILE);
+    TRACE_FILE = NULL;
+}
+
+void TraceSetThreadName(const char* name)
+{
+    if (!TRACE_FILE)
+        return;
+
+    pthread_mutex_lock(&TRACE_LOCK);
+    BeginEvent();
+    fprintf(TRACE_FILE, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}", TRACE_PID, GetTid(), name);
+    pthread_mutex_unlock(&TRACE_LOCK);
+}
+
+void TraceBegin(struct trace_span* span, const char* name)
+{
+    span->name = name;
+    span->start = TRACE_FILE ? GetMicroseconds() : 0.0;
+}
+
+void TraceEnd(struct trace_span* span, int64_t bytes, int64_t samples)
+{
+    if (!TRACE_FILE)
+        return;
+
+    double end = GetMicroseconds();
+    pthread_mutex_lock(&TRACE_LOCK);
+    BeginEvent();
+    fprintf(TRACE_FILE, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"bytes\":%" PRId64 ",\"samples\":%" PRId64 "}}",
+            span->name, TRACE_PID, GetTid(), span->start - TRACE_EPOCH, end - span->start,
+            bytes, samples);
+    pthread_mutex_unlock(&TRACE_LOCK);
+}
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "dspenc.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+/* Frames listed in the report, largest error first */
+#define VERIFY_WORST_FRAMES 5
+
+/* Round-trip verifier
+ * Encoded packets are copied into chunks and queued for a decoder thread
+ * that starts from silent history like any player would. Every decoded
+ * sample must match the encoder's reconstruction exactly; quality stats
+ * against the source are gathered along the way. Decoding is far cheaper
+ * than encoding, so the queue stays short and the check finishes right
+ * behind the encoder.
+ */
+struct verify_chunk
+{
+    struct verify_chunk* next;
+    int64_t samples;
+    int16_t* pcm;
+    short* recon;
+    unsigned char* adpcm;
+};
+
+struct verify_frame
+{
+    int64_t packet;
+    int numSamples; /* Short for a partial final packet */
+    double signal;
+    double noise;
+};
+
+struct dsp_verifier
+{
+    short coefs[8][2];
+    short hist[2];
+    int64_t packet;
+    int64_t sample;
+
+    int64_t mismatches;
+    int64_t firstMismatch;
+    int64_t clipped;
+    int64_t clippedPackets;
+    int64_t firstClip;
+    double signal;
+    double noise;
+    struct verify_frame worst[VERIFY_WORST_FRAMES];
+    int worstCount;
+
+    struct verify_chunk* head;
+    struct verify_chunk* tail;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int threaded;
+};
+
+/* 10log10 of the energy ratio; infinite for a lossless encode */
+double GetSNR(double signal, double noise)
+{
+    if (noise == 0.0)
+        return INFINITY;
+    return 10.0 * log10(signal / noise);
+}
+
+static void AddWorstFrame(struct dsp_verifier* v, int64_t packet, int numSamples, double signal, double noise)
+{
+    if (noise == 0.0)
+        return;
+    if (v->worstCount == VERIFY_WORST_FRAMES && noise <= v->worst[VERIFY_WORST_FRAMES-1].noise)
+        return;
+
+    int i = v->worstCount < VERIFY_WORST_FRAMES ? v->worstCount++ : VERIFY_WORST_FRAMES - 1;
+    for (; i > 0 && v->worst[i-1].noise < noise ; --i)
+        v->worst[i] = v->worst[i-1];
+    v->worst[i].packet = packet;
+    v->worst[i].numSamples = numSamples;
+    v->worst[i].signal = signal;
+    v->worst[i].noise = noise;
+}
+
+static void VerifyChunk(struct dsp_verifier* v, const struct verify_chunk* chunk)
+{
+    struct trace_span span;
+    TraceBegin(&span, "verify");
+
+    short pcmOut[PACKET_SAMPLES];
+    for (int64_t i=0 ; i*PACKET_SAMPLES<chunk->samples ; ++i)
+    {
+        int numSamples = (int)MIN(chunk->samples - i * PACKET_SAMPLES, PACKET_SAMPLES);
+        const int16_t* src = chunk->pcm + i * PACKET_SAMPLES;
+        const short* recon = chunk->recon + i * PACKET_SAMPLES;
+        DSPDecodeFrame(chunk->adpcm + i * PACKET_BYTES, numSamples, v->hist,
+                       (const short(*)[2])v->coefs, pcmOut);
+
+        if (memcmp(pcmOut, recon, numSamples * sizeof(short)))
+        {
+            if (!v->mismatches)
+                v->firstMismatch = v->packet;
+            ++v->mismatches;
+        }
+
+        double signal = 0.0, noise = 0.0;
+        int clipped = 0;
+        for (int s=0 ; s<numSamples ; ++s)
+        {
+            double err = (double)src[s] - pcmOut[s];
+            signal += (double)src[s] * src[s];
+            noise += err * err;
+
+            /* Decoder saturated where the source didn't */
+            if ((pcmOut[s] == 32767 || pcmOut[s] == -32768) && pcmOut[s] != src[s])
+            {
+                if (!v->clipped && !clipped)
+                    v->firstClip = v->sample + s;
+                ++clipped;
+            }
+        }
+
+        if (clipped)
+        {
+            v->clipped += clipped;
+            ++v->clippedPackets;
+        }
+        v->signal += signal;
+        v->noise += noise;
+        AddWorstFrame(v, v->packet, numSamples, signal, noise);
+
+        ++v->packet;
+        v->sample += numSamples;
+    }
+
+    TraceEnd(&span, GetBytesForAdpcmSamples(chunk->samples), chunk->samples);
+}
+
+static void FreeChunk(struct verify_chunk* chunk)
+{
+    free(chunk->pcm);
+    free(chunk->recon);
+    free(chunk->adpcm);
+    free(chunk);
+}
+
+static void* VerifyThread(void* arg)
+{
+    struct dsp_verifier* v = arg;
+    TraceSetThreadName("verify");
+
+    for (;;)
+    {
+        pthread_mutex_lock(&v->lock);
+        while (!v->head && !v->done)
+            pthread_cond_wait(&v->cond, &v->lock);
+        struct verify_chunk* chunk = v->head;
+        if (chunk)
+        {
+            v->head = chunk->next;
+            if (!v->head)
+                v->tail = NULL;
+        }
+        pthread_mutex_unlock(&v->lock);
+
+        if (!chunk)
+            break;
+        VerifyChunk(v, chunk);
+        FreeChunk(chunk);
+    }
+
+    return NULL;
+}
+
+struct dsp_verifier* VerifyStart(const short coefs[8][2])
+{
+    struct dsp_verifier* v = calloc(1, sizeof(struct dsp_verifier));
+    memcpy(v->coefs, coefs, sizeof(v->coefs));
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->cond, NULL);
+
+    /* Without a thread, chunks are checked as they're submitted */
+    v->threaded = 1;
+    if (pthread_create(&v->thread, NULL, VerifyThread, v))
+        v->threaded = 0;
+
+    return v;
+}
+
+void VerifySubmit(struct dsp_verifier* v, const int16_t* pcm, const short* recon,
+                  const unsigned char* adpcm, int64_t samples)
+{
+    if (samples <= 0)
+        return;
+
+    int64_t packets = samples / PACKET_SAMPLES + (samples % PACKET_SAMPLES != 0);
+    struct verify_chunk* chunk = malloc(sizeof(struct verify_chunk));
+    chunk->next = NULL;
+    chunk->samples = samples;
+    chunk->pcm = malloc(samples * sizeof(int16_t));
+    chunk->recon = malloc(samples * sizeof(short));
+    chunk->adpcm = malloc(packets * PACKET_BYTES);
+    memcpy(chunk->pcm, pcm, samples * sizeof(int16_t));
+    memcpy(chunk->recon, recon, samples * sizeof(short));
+    memcpy(chunk->adpcm, adpcm, packets * PACKET_BYTES);
+
+    if (!v->threaded)
+    {
+        VerifyChunk(v, chunk);
+        FreeChunk(chunk);
+        return;
+    }
+
+    pthread_mutex_lock(&v->lock);
+    if (v->tail)
+        v->tail->next = chunk;
+    else
+        v->head = chunk;
+    v->tail = chunk;
+    pthread_cond_signal(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+}
+
+int VerifyFinish(struct dsp_verifier* v)
+{
+    if (v->threaded)
+    {
+        pthread_mutex_lock(&v->lock);
+        v->done = 1;
+        pthread_cond_signal(&v->cond);
+        pthread_mutex_unlock(&v->lock);
+        pthread_join(v->thread, NULL);
+    }
+
+    printf("VERIFY: %" PRId64 " packets decoded, %" PRId64 " mismatched the encoder",
+           v->packet, v->mismatches);
+    if (v->mismatches)
+        printf(" (first at packet %" PRId64 ")", v->firstMismatch);
+    printf("\nVERIFY: SNR %.2f dB", GetSNR(v->signal, v->noise));
+    if (v->clipped)
+        printf(", %" PRId64 " clipped samples in %" PRId64 " packets (first at sample %" PRId64 ")\n",
+               v->clipped, v->clippedPackets, v->firstClip);
+    else
+        printf(", no clipping\n");
+    for (int i=0 ; i<v->worstCount ; ++i)
+        printf("VERIFY: worst packet %" PRId64 " at sample %" PRId64 ": RMS error %.1f, SNR %.2f dB\n",
+               v->worst[i].packet, v->worst[i].packet * PACKET_SAMPLES,
+               sqrt(v->worst[i].noise / v->worst[i].numSamples), GetSNR(v->worst[i].signal, v->worst[i].noise));
+
+    int ret = v->mismatches != 0;
+    pthread_cond_destroy(&v->cond);
+    pthread_mutex_destroy(&v->lock);
+    free(v);
+
+    return ret;
+}
@@ -0,0 +1,251 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "dspenc.h"
+
+/* Sony Wave64 chunk GUIDs; 'riff' differs from the others past the FourCC */
+static const uint8_t W64_RIFF_GUID[16] =
+    {'r','i','f','f', 0x2E,0x91,0xCF,0x11, 0xA5,0xD6,0x28,0xDB, 0x04,0xC1,0x00,0x00};
+static const uint8_t W64_WAVE_GUID[16] =
+    {'w','a','v','e', 0xF3,0xAC,0xD3,0x11, 0x8C,0xD1,0x00,0xC0, 0x4F,0x8E,0xDB,0x8A};
+static const uint8_t W64_FMT_GUID[16] =
+    {'f','m','t',' ', 0xF3,0xAC,0xD3,0x11, 0x8C,0xD1,0x00,0xC0, 0x4F,0x8E,0xDB,0x8A};
+static const uint8_t W64_DATA_GUID[16] =
+    {'d','a','t','a', 0xF3,0xAC,0xD3,0x11, 0x8C,0xD1,0x00,0xC0, 0x4F,0x8E,0xDB,0x8A};
+static const uint8_t W64_SMPL_GUID[16] =
+    {'s','m','p','l', 0xF3,0xAC,0xD3,0x11, 0x8C,0xD1,0x00,0xC0, 0x4F,0x8E,0xDB,0x8A};
+
+static uint16_t ReadU16(FILE* fin)
+{
+    uint16_t v = 0;
+    fread(&v, 1, 2, fin);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap16(v);
+#endif
+    return v;
+}
+
+static uint32_t ReadU32(FILE* fin)
+{
+    uint32_t v = 0;
+    fread(&v, 1, 4, fin);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t ReadU64(FILE* fin)
+{
+    uint64_t v = 0;
+    fread(&v, 1, 8, fin);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/* Validate fmt chunk body; only mono 16-bit PCM is accepted */
+static int ParseFmt(FILE* fin, const char* path, struct wav_info* info)
+{
+    uint16_t fmt = ReadU16(fin);
+    if (fmt != 1)
+    {
+        fprintf(stderr, "'%s' has invalid format %u\n", path, fmt);
+        return 1;
+    }
+
+    uint16_t nchan = ReadU16(fin);
+    if (nchan != 1)
+    {
+        fprintf(stderr, "'%s' must have 1 channel, not %u\n", path, nchan);
+        return 1;
+    }
+
+    info->sampleRate = ReadU32(fin);
+    fseeko(fin, 4, SEEK_CUR);
+
+    uint16_t bytesPerSample = ReadU16(fin);
+    if (bytesPerSample != 2)
+    {
+        fprintf(stderr, "'%s' must have 2 bytes per sample, not %u\n", path, bytesPerSample);
+        return 1;
+    }
+
+    uint16_t bitsPerSample = ReadU16(fin);
+    if (bitsPerSample != 16)
+    {
+        fprintf(stderr, "'%s' must have 16 bits per sample, not %u\n", path, bitsPerSample);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Sampler chunk; the first loop becomes the stream loop (end inclusive) */
+static void ParseSmpl(FILE* fin, uint64_t chunkSz, struct wav_info* info)
+{
+    if (chunkSz < 36 + 24)
+        return;
+
+    fseeko(fin, 28, SEEK_CUR);
+    uint32_t loopCount = ReadU32(fin);
+    ReadU32(fin); /* sampler data */
+    if (!loopCount)
+        return;
+
+    ReadU32(fin); /* cue point id */
+    ReadU32(fin); /* type */
+    info->loop.start = ReadU32(fin);
+    info->loop.end = ReadU32(fin);
+}
+
+/* RIFF/WAVE and RF64/WAVE; RF64 keeps 64-bit sizes in the leading ds64 chunk
+ * Chunks after data are scanned too, since smpl often trails the samples */
+static int ParseRiff(FILE* fin, const char* path, struct wav_info* info, int rf64)
+{
+    char riffcheck[4];
+    uint64_t ds64DataSize = 0;
+
+    fseeko(fin, 4, SEEK_CUR);
+    fread(riffcheck, 1, 4, fin);
+    if (memcmp(riffcheck, "WAVE", 4))
+    {
+        fprintf(stderr, "'%s' not a valid WAVE file\n", path);
+        return 1;
+    }
+
+    while (fread(riffcheck, 1, 4, fin) == 4)
+    {
+        uint64_t chunkSz = ReadU32(fin);
+        if (rf64 && chunkSz == 0xFFFFFFFF && !memcmp(riffcheck, "data", 4))
+            chunkSz = ds64DataSize;
+        off_t chunkEnd = ftello(fin) + chunkSz + (chunkSz & 1);
+
+        if (!memcmp(riffcheck, "ds64", 4))
+        {
+            ReadU64(fin); /* RIFF size */
+            ds64DataSize = ReadU64(fin);
+        }
+        else if (!memcmp(riffcheck, "fmt ", 4))
+        {
+            if (ParseFmt(fin, path, info))
+                return 1;
+        }
+        else if (!memcmp(riffcheck, "data", 4))
+        {
+            info->sampleCount = chunkSz / 2;
+            info->dataOffset = ftello(fin);
+        }
+        else if (!memcmp(riffcheck, "smpl", 4))
+            ParseSmpl(fin, chunkSz, info);
+
+        fseeko(fin, chunkEnd, SEEK_SET);
+    }
+
+    return 0;
+}
+
+/* Wave64; chunk sizes include the 24-byte header and chunks are 8-byte aligned */
+static int ParseW64(FILE* fin, const char* path, struct wav_info* info)
+{
+    uint8_t guid[16];
+
+    ReadU64(fin); /* riff size */
+    fread(guid, 1, 16, fin);
+    if (memcmp(guid, W64_WAVE_GUID, 16))
+    {
+        fprintf(stderr, "'%s' not a valid WAVE file\n", path);
+        return 1;
+    }
+
+    while (fread(guid, 1, 16, fin) == 16)
+    {
+        uint64_t chunkSz = ReadU64(fin);
+        if (chunkSz < 24)
+            break;
+        off_t chunkEnd = ftello(fin) - 24 + ((chunkSz + 7) & ~(uint64_t)7);
+
+        if (!memcmp(guid, W64_FMT_GUID, 16))
+        {
+            if (ParseFmt(fin, path, info))
+                return 1;
+        }
+        else if (!memcmp(guid, W64_DATA_GUID, 16))
+        {
+            info->sampleCount = (chunkSz - 24) / 2;
+            info->dataOffset = ftello(fin);
+        }
+        else if (!memcmp(guid, W64_SMPL_GUID, 16))
+            ParseSmpl(fin, chunkSz - 24, info);
+
+        fseeko(fin, chunkEnd, SEEK_SET);
+    }
+
+    return 0;
+}
+
+FILE* WAVOpen(const char* path, struct wav_info* info)
+{
+    memset(info, 0, sizeof(*info));
+    info->loop.end = -1;
+
+    FILE* fin = fopen(path, "rb");
+    if (!fin)
+    {
+        fprintf(stderr, "'%s' won't open - %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    uint8_t riffcheck[16];
+    int err;
+    fread(riffcheck, 1, 4, fin);
+    if (!memcmp(riffcheck, "RIFF", 4))
+        err = ParseRiff(fin, path, info, 0);
+    else if (!memcmp(riffcheck, "RF64", 4))
+        err = ParseRiff(fin, path, info, 1);
+    else if (fread(riffcheck + 4, 1, 12, fin) == 12 && !memcmp(riffcheck, W64_RIFF_GUID, 16))
+        err = ParseW64(fin, path, info);
+    else
+    {
+        fprintf(stderr, "'%s' not a valid RIFF file\n", path);
+        err = 1;
+    }
+
+    if (!err && (!info->sampleRate || !info->sampleCount))
+    {
+        fprintf(stderr, "'%s' must have a valid data chunk following a fmt chunk\n", path);
+        err = 1;
+    }
+
+    if (err)
+    {
+        fclose(fin);
+        return NULL;
+    }
+
+    return fin;
+}
+
+int WAVSeekSample(FILE* fin, const struct wav_info* info, int64_t sample)
+{
+    return fseeko(fin, info->dataOffset + sample * 2, SEEK_SET);
+}
+
+/* Read count samples in host order, zero-filling past a truncated data chunk */
+int64_t WAVReadSamples(FILE* fin, int16_t* buf, int64_t count)
+{
+    int64_t readCount = fread(buf, 2, count, fin);
+    memset(buf + readCount, 0, (count - readCount) * 2);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (int64_t i=0 ; i<readCount ; i++)
+        buf[i] = __builtin_bswap16(buf[i]);
+#endif
+
+    return readCount;
+}